@@ -1,6 +1,18 @@
+#include <math.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef HM_NO_THREADS
+#include <pthread.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "stb_vorbis.h"
 
@@ -9,6 +21,352 @@
 
 #define FREQUENCY_MULTIPLIER 0.05946f
 
+#define HM_PI 3.14159265358979323846 // M_PI is POSIX, not C
+
+#define HM_SAMPLE_HEADER_SIZE 41 // Bytes of settings before a sample's data
+
+/*
+ * Frames stored past the end of every sample: the start of the loop for
+ * looping samples, silence for the rest. Reads can run into them without
+ * checking where the sample ends, as far as the widest filter reaches.
+ */
+#define HM_GUARD_FRAMES 8
+
+#define HM_BLOCK_FRAMES 256 // Most frames rendered between passes over a mix
+
+#if defined(__GNUC__)
+#define HM_INLINE static inline __attribute__((always_inline))
+#else
+#define HM_INLINE static inline
+#endif
+
+/* Load flags */
+#define HM_PACK_PCM 1 // Keep PCM samples packed and decode them on demand
+/*
+ * Convert samples to the output rate at load, every one or only those never
+ * played transposed. Loops that don't come to a whole number of frames at
+ * the new rate are left alone so they keep their period.
+ */
+#define HM_RESAMPLE 2
+#define HM_RESAMPLE_FIXED 4
+/*
+ * Once a pass through the loop ends with every channel as it was when the
+ * pass began, play further passes from a recording of it, kept as int16
+ * with HM_CACHE_LOOP_S16. Stems are always rendered live.
+ */
+#define HM_CACHE_LOOP 8
+#define HM_CACHE_LOOP_S16 16
+/*
+ * Keep half-band filtered copies of each sample, an octave apart, after its
+ * frames. Voices stepping through a sample fast read the copy that brings
+ * the step under HM_MIPMAP_STEP, so high notes don't alias.
+ */
+#define HM_MIPMAP 32
+/*
+ * Share decoded samples with every other context loaded with this flag.
+ * Samples with the same packed data and format are decoded and stored
+ * once, and freed with the last context using them. The cache is only
+ * used while loading and by the prefetch thread: a sample decoded at its
+ * note gets a copy of its own, and copies evicted while playing are given
+ * back by the prefetch thread, hm_set_prefetch, hm_patch_begin,
+ * hm_patch_commit or hm_free_context.
+ */
+#define HM_SHARE_SAMPLES 64
+
+#define HM_RESAMPLE_TAPS 16 // Zero crossings each side of the load resampler
+#define HM_RESAMPLE_PHASES 256 // Filter table entries per zero crossing
+
+/* Interpolation between sample frames, see hm_set_interpolation */
+#define HM_INTERPOLATE_NEAREST 0
+#define HM_INTERPOLATE_LINEAR 1
+#define HM_INTERPOLATE_HERMITE 2 // 4-point cubic
+#define HM_INTERPOLATE_SINC8 3 // 8-tap windowed sinc
+#define HM_INTERPOLATE_SINC16 4
+#define HM_INTERPOLATE_MODES 5
+#define HM_INTERPOLATE_PHASES 512 // Filter rows between two sample frames
+
+#define HM_SHARE_BUCKETS 256 // Hash chains in the shared sample cache
+
+/* Baked files, see hm_bake */
+#define HM_BAKED_MAGIC 0x4B424D48 // "HMBK" read in this machine's byte order
+#define HM_BAKED_VERSION 1
+#define HM_BAKED_ALIGN 64 // Of each sample's frames within the file
+/* Load flags that change what gets baked */
+#define HM_BAKED_FLAGS (HM_RESAMPLE | HM_RESAMPLE_FIXED | HM_MIPMAP)
+
+#define HM_MIPMAP_LEVELS 4 // Most copies below the sample
+#define HM_MIPMAP_MIN_FRAMES 64 // Shortest copy worth keeping
+#define HM_MIPMAP_TAPS 16 // Taps each side of the half-band filter
+#define HM_MIPMAP_STEP 1.5 // Largest step read before moving down a level
+
+#define HM_UPSAMPLE_TAPS 8 // Taps each side of the master bus upsampler
+#define HM_UPSAMPLE_PHASES 128 // Filter rows between two mixed frames
+
+#define HM_NO_SAMPLE 0xFFFF
+
+#define HM_OPEN_TICKS 16 // Ticks whose samples hm_open_context waits for
+
+#if defined(__GNUC__)
+#define HM_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define HM_PREFETCH(address)
+#endif
+
+#define HM_PREFETCH_LINES 4 // Cache lines of a sample touched before its note
+#define HM_PREFETCH_POLL_MS 5 // Longest the prefetch thread sleeps unasked
+
+/*
+ * Quality levels, each giving up a little more than the last: linear to
+ * nearest-neighbour reads, then ramps and trills updated every
+ * HM_CONTROL_FRAMES frames, then fewer voices at each level above.
+ */
+#define HM_QUALITY_FULL 0
+#define HM_QUALITY_NEAREST 1
+#define HM_QUALITY_CONTROL_RATE 2
+#define HM_QUALITY_SHED 3
+#define HM_QUALITY_MAX 5
+
+#define HM_CONTROL_FRAMES 32
+
+/* Mixing cost of a voice relative to a plain mono one, for hm_analyze */
+#define HM_COST_STEREO 1.5f
+#define HM_COST_MODULATED 4.0f
+
+/* The governor steps down when the load goes over budget */
+#define HM_GOVERNOR_SETTLE 4 // Calls between steps down
+#define HM_GOVERNOR_HOLD 32 // Calls with headroom before a step up
+#define HM_GOVERNOR_HEADROOM 0.5f // Load under this much of the budget
+
+/* Playback events hm_set_sync can queue for the game */
+#define HM_SYNC_TICK 1
+#define HM_SYNC_BEAT 2 // First tick of each beat
+#define HM_SYNC_NOTE_ON 4
+#define HM_SYNC_NOTE_OFF 8
+#define HM_SYNC_COMMAND 16 // Commands 8 to 15, which play no part in the mix
+
+/* Loop cache states */
+#define HM_LOOP_CACHE_IDLE 0
+#define HM_LOOP_CACHE_RECORDING 1
+#define HM_LOOP_CACHE_PLAYING 2
+
+#define HM_DURATION_INFINITE UINT64_MAX
+
+/* Event flags */
+#define HM_EVENT_NOTE 1
+#define HM_EVENT_KEY_OFF 2
+#define HM_EVENT_COMMAND 4
+
+/* A non-empty pattern cell, compiled at load */
+struct hm_event {
+	uint8_t channel;
+	uint8_t flags;
+	uint8_t note;
+	uint16_t sample_id; // HM_NO_SAMPLE keeps the channel's last sample
+
+	uint8_t command_id;
+	uint8_t command_param;
+	uint8_t command; // Low nibble of command_id
+	uint8_t modifier; // High nibble of command_id
+	uint8_t period; // Trill period in hundredths of a second
+	int32_t target; // Parameter with its offset removed
+	float level; // Volume or pan to set right away
+};
+
+/* Sample formats for file sinks */
+#define HM_FORMAT_F32 0
+#define HM_FORMAT_S16 1
+
+#define HM_EXPORT_BUFFERS 3 // Chunks in flight between render and sink
+
+/*
+ * Length of a module at the context's output rate: the frames before the
+ * loop point, the frames of one pass through the loop, and the frames
+ * voices still sound for if playback ends after the last tick.
+ */
+struct hm_duration {
+	uint64_t intro_frames;
+	uint64_t loop_frames;
+	uint64_t tail_frames;
+};
+
+/* Output flags */
+#define HM_OUTPUT_MONO 1 // Average left and right into the left buffer
+#define HM_OUTPUT_ACCUMULATE 2 // Add to what the buffers hold already
+
+/*
+ * Where hm_generate_output writes each frame: left[i * stride] and
+ * right[i * stride], scaled by gain. Interleaved stereo is right = left + 1
+ * with a stride of 2, planar buffers a stride of 1, and a channel pair on
+ * a wider bus a stride of the bus width.
+ */
+struct hm_output {
+	float *left;
+	float *right; // Unused for HM_OUTPUT_MONO
+	uint32_t stride;
+	float gain;
+	uint32_t flags;
+};
+
+#define HM_MIXER_SOURCES 8
+
+struct hm_mixer_source {
+	struct hm_context *ctx; // NULL for a free slot
+	float gain;
+	float fade_step; // Added to gain each frame while fading
+	float fade_target;
+	uint32_t fade_frames; // Left in the current fade
+	uint8_t remove; // Free the source once its fade ends
+};
+
+/* Plays several modules into one output, each owned by the mixer */
+struct hm_mixer {
+	struct hm_mixer_source sources[HM_MIXER_SOURCES];
+	float mix[HM_BLOCK_FRAMES * 2];
+};
+
+/* Worst case of a module, found by hm_analyze */
+struct hm_analysis {
+	uint8_t max_voices; // Most voices sounding in any tick
+	uint8_t max_modulated; // Most of them following ramps or trills
+	uint32_t ramp_commands;
+	uint32_t trill_commands;
+	float ramp_density; // Ramp commands per tick
+	float trill_density;
+	float peak_cost; // Mixing cost of the busiest frame, in plain voices
+	float headroom; // Largest sum of peak amplitudes sounding together
+};
+
+struct hm_sync_event {
+	uint64_t frame; // Output frame the tick starts on
+	uint32_t tick;
+	uint8_t type; // One HM_SYNC_ type
+	uint8_t channel;
+	uint8_t note;
+	uint8_t command; // Low nibble of the command, with its param
+	uint8_t param;
+	uint16_t sample_id;
+};
+
+/* Sample settings a patch can change, see hm_patch_sample */
+struct hm_sample_params {
+	float vol;
+	float pan;
+	uint8_t relative_note;
+	uint8_t key_range_start;
+	uint8_t key_range_end;
+	uint8_t envelope;
+	uint16_t envelope_ms[5]; // Predelay, attack, hold, decay and fadeout
+	float sustain;
+};
+
+/*
+ * The next version of a module's pattern and sample settings, built on the
+ * game thread by hm_patch_begin and the calls after it, and handed over by
+ * hm_patch_commit. Playback switches to it at the next tick boundary.
+ */
+struct hm_patch {
+	uint8_t *data; // length rows of num_channels cells, 4 bytes each
+	uint16_t length;
+	uint16_t loop_position;
+	uint8_t num_channels;
+	uint16_t num_samples;
+	struct hm_sample_params *params;
+
+	/* Compiled by hm_patch_commit */
+	struct hm_event *events;
+	uint32_t *tick_events;
+
+	/* Ticks inserted (positive count) or removed, as tick, count pairs */
+	int32_t *moves;
+	uint32_t move_count;
+
+	void *loop_cache; // Given up by the render thread, for the game to free
+	struct hm_patch *next; // In the context's retired list
+};
+
+struct hm_stats {
+	uint8_t quality; // HM_QUALITY_ level in use
+	uint8_t active_voices;
+	uint8_t shed_voices; // Skipped in the last block to save time
+	float load; // Smoothed render time over audio time, with a governor
+	float budget; // The governor's target load, 0 when it's off
+	uint32_t sync_dropped; // Events lost to a full sync queue
+};
+
+/* Receives rendered audio from hm_export */
+struct hm_sink {
+	/* Takes interleaved stereo frames in order, nonzero aborts the export */
+	int (*write)(void *user, const float *frames, uint32_t frame_count);
+	/* Called once after the last chunk, may be NULL */
+	int (*close)(void *user);
+	void *user;
+};
+
+/* Where hm_open_context reads a module from */
+struct hm_reader {
+	/* Copies length bytes from offset into buffer, nonzero on failure */
+	int (*read)(void *user, uint64_t offset, void *buffer,
+		uint32_t length);
+	void *user;
+};
+
+/* State for the raw PCM and WAV sinks set up by hm_file_sink */
+struct hm_file_sink {
+	FILE *file;
+	uint32_t rate;
+	uint8_t format;
+	uint8_t wav;
+	uint64_t frames_written;
+	int16_t convert[HM_BLOCK_FRAMES * 2];
+};
+
+struct hm_load_options {
+	uint64_t sample_budget; // Bytes of decoded frames to keep, 0 for no limit
+	uint32_t flags;
+	uint32_t mix_rate; // Rate voices are mixed at, 0 for the output rate
+	/*
+	 * Contents of a file written by hm_bake, usually mapped straight from
+	 * disk, or NULL. Sample frames are played from it in place, so it has
+	 * to stay put until the context is freed, aligned to 8 bytes at
+	 * least. Ignored if it was baked from another module or with other
+	 * options.
+	 */
+	const void *baked;
+	uint64_t baked_length;
+};
+
+/*
+ * Layout of a baked file: this header, a struct hm_baked_sample for each
+ * sample, tick_events and events as compiled, then each sample's frames
+ * starting on an HM_BAKED_ALIGN boundary. Everything is in the byte order
+ * and struct layout of the machine that baked it.
+ */
+struct hm_baked_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t source_hash; // Of the whole module
+	uint32_t source_length;
+	uint32_t rate; // Voices are mixed at
+	uint32_t flags; // Load flags in HM_BAKED_FLAGS
+	uint32_t event_size; // sizeof(struct hm_event)
+	uint32_t event_count;
+	uint16_t num_samples;
+	uint16_t length;
+};
+
+struct hm_baked_sample {
+	uint64_t offset; // Of the frames, from the start of the file
+	uint64_t size; // In bytes, guard frames and mipmaps included
+	uint32_t frame_count;
+	uint32_t sample_rate;
+	uint32_t loop_start;
+	float peak;
+	uint8_t channels;
+	uint8_t loop;
+	uint8_t resampled;
+	uint8_t mip_levels;
+};
+
 struct hm_sample {
 	uint8_t instrument_id;
 	uint8_t ogg;
@@ -36,9 +394,41 @@ struct hm_sample {
 	uint32_t decay;
 	float sustain;
 	uint32_t fadeout;
-	uint64_t envelope_timer;
+	/* Predelay, attack, hold, decay and fadeout in ms, as stored */
+	uint16_t envelope_ms[5];
 
+	float vol; // Already applied to frames
+	float gain; // Volume set by patches, relative to vol
 	float *frames;
+
+	/* As stored in the module, before any resampling */
+	uint32_t data_offset;
+	uint32_t source_frame_count;
+	uint32_t source_rate;
+	uint32_t source_loop_start;
+	uint8_t resampled;
+	uint8_t mip_levels; // Decimated copies stored after frames
+	uint8_t shared; // Decoded through the shared sample cache
+	uint8_t cached; // frames hold a reference on the shared cache
+	uint8_t baked; // frames point into hm_load_options.baked
+	uint64_t share_hash; // Of the packed data, for the cache
+
+	uint8_t *source; // Packed data kept for samples that can be evicted
+	uint32_t last_use;
+	uint16_t pins; // Voices currently playing this sample
+	uint8_t loop_pinned; // Holds a pin while the loop cache plays
+	float peak; // Largest magnitude in frames, negative until decoded
+
+	/* Decoded by the prefetch thread ahead of the note, taken at note-on */
+	_Atomic(float *) prefetched;
+	float prefetched_peak;
+	_Atomic uint8_t prefetch_queued;
+
+	/* Cache references the render thread let go of, see hm_collect_frames */
+	_Atomic(float *) retired_frames;
+	_Atomic uint32_t retired;
+
+	_Atomic uint8_t loaded; // Data read, always set unless hm_open_context
 };
 
 struct hm_ramp {
@@ -58,10 +448,18 @@ struct hm_trill {
 	uint32_t frame_length;
 };
 
+struct hm_context;
+struct hm_channel;
+
+/* Renders up to count frames of a voice and returns how many it covered */
+typedef uint32_t (*hm_kernel)(struct hm_context *ctx,
+	struct hm_channel *channel, float *buffer, uint32_t count);
+
 struct hm_channel {
 	uint16_t sample_id;
 	uint8_t base_note; // Note being played
 	uint8_t key_off; // Note being played
+	uint8_t pinned; // Holds a pin on sample_id
 
 	uint8_t command_id;
 	uint8_t command_param;
@@ -76,14 +474,19 @@ struct hm_channel {
 	int64_t sample_frame;
 	double pos_between_samples; // For resampling and pitch shifting
 
+	uint32_t envelope_timer;
 	uint32_t fadeout_timer;
 
 	struct hm_ramp ramps[4];
 	struct hm_trill trills[2];
+
+	hm_kernel kernel; // Chosen from the voice's state, NULL to pick again
 };
 
 struct hm_context {
 	uint8_t *data;
+	struct hm_event *events;
+	uint32_t *tick_events; // First event of each tick, length + 1 entries
 
 	char name[HM_MODULE_NAME_LENGTH];
 	uint32_t rate;
@@ -101,6 +504,78 @@ struct hm_context {
 	uint32_t samples_left_in_tick;
 	struct hm_channel channels[HM_MAX_CHANNELS];
 	struct hm_sample *samples;
+
+	uint64_t sample_budget;
+	uint64_t sample_memory; // Bytes of decoded frames currently resident
+	uint32_t sample_clock;
+
+	float scratch[HM_BLOCK_FRAMES * 2];
+
+	uint32_t flags; // Load flags
+	uint8_t loop_cache_state;
+	void *loop_cache; // One pass of the loop, float or int16 frames
+	uint64_t loop_cache_frames; // Frames recorded in the current pass
+	struct hm_channel loop_start[HM_MAX_CHANNELS]; // At the pass's start
+
+	uint8_t interpolation; // HM_INTERPOLATE_ mode at full quality
+	float *interpolation_filter; // HM_INTERPOLATE_PHASES + 1 rows of taps
+	uint8_t quality;
+	uint32_t control_frames; // Frames between ramp and trill updates
+	uint8_t voice_limit;
+	uint8_t priority[HM_MAX_CHANNELS]; // Higher is shed last
+	uint8_t shed_voices;
+	float budget;
+	float load;
+	uint32_t calm_calls; // In a row with headroom
+	uint32_t settle_calls; // Since the last step down
+	uint8_t unclamped; // hm_set_clamp found the mix can't pass full scale
+
+	/* Sync events, written by the render thread and read by the game's */
+	uint32_t sync_mask;
+	struct hm_sync_event *sync_events;
+	uint32_t sync_capacity; // A power of two
+	_Atomic uint32_t sync_head; // Next slot to write
+	_Atomic uint32_t sync_tail; // Next slot to read
+	_Atomic uint32_t sync_dropped;
+	uint64_t tick_start; // Mixed frames before the current tick
+	uint64_t tick_end;
+
+	/* Master bus resampler, used while rate differs from output_rate */
+	uint32_t output_rate;
+	float *bus_filter; // HM_UPSAMPLE_PHASES + 1 rows of taps
+	double bus_step; // Mixed frames per output frame
+	double bus_position; // Of the next output frame, in bus frames
+	uint32_t bus_frames;
+	float bus[(HM_BLOCK_FRAMES + HM_UPSAMPLE_TAPS * 2) * 2];
+
+	/* Live edits, committed by the game thread and taken by the render's */
+	_Atomic(struct hm_patch *) patch_pending;
+	_Atomic(struct hm_patch *) patch_retired; // Swapped out, to be freed
+	struct hm_patch *patch_base; // Game thread's copy of the latest version
+
+	/* Look-ahead decoding, see hm_set_prefetch */
+	uint32_t prefetch_ticks;
+	uint16_t *prefetch_queue; // Sample ids, num_samples slots
+	_Atomic uint32_t prefetch_head; // Written by the render thread
+	_Atomic uint32_t prefetch_tail; // Written by the prefetch thread
+	uint8_t prefetch_running;
+#ifndef HM_NO_THREADS
+	uint8_t prefetch_stop;
+	pthread_t prefetch_thread;
+	pthread_mutex_t prefetch_lock;
+	pthread_cond_t prefetch_wake;
+#endif
+
+	/* Samples hm_open_context reads after returning, in load_order */
+	struct hm_reader reader;
+	uint16_t *load_order; // Sample ids by the tick they first play on
+	_Atomic uint16_t load_pending; // Samples left to read
+	_Atomic uint8_t load_failed;
+	_Atomic uint8_t load_stop;
+	uint8_t load_running;
+#ifndef HM_NO_THREADS
+	pthread_t load_thread;
+#endif
 };
 
 static inline uint16_t hm_read_16(const uint8_t *data, uint32_t *i) {
@@ -117,614 +592,4603 @@ static inline uint32_t hm_read_32(const uint8_t *data, uint32_t *i) {
 	return a << 24 | b << 16 | c << 8 | d;
 }
 
+/* Frames in level of a sample's copies, level 0 being the sample */
+static uint32_t
+hm_mip_frames(const struct hm_sample *sample, int level)
+{
+	return (sample->frame_count + (1u << level) - 1) >> level;
+}
+
+static uint64_t
+hm_sample_size(const struct hm_sample *sample)
+{
+	uint64_t frames = 0;
+	int i;
+	for (i = 0; i <= sample->mip_levels; i++)
+		frames += (uint64_t) hm_mip_frames(sample, i) + HM_GUARD_FRAMES;
+	return frames * sample->channels * sizeof(float);
+}
+
+/*
+ * Sets up view to read a level of the sample stored in frames as a sample
+ * of its own. Only the fields reads and wraps look at are filled in.
+ */
 static void
-hm_load_samples(struct hm_context *ctx, const uint8_t *data,
-	uint32_t data_length, uint32_t *index)
+hm_mip_view(const struct hm_sample *sample, float *frames, int level,
+	struct hm_sample *view)
 {
-	const float envelope_multiplier = (float) ctx->rate / 1000.0f;
-	int32_t temp_thirty_two;
 	int i;
-	uint32_t j;
-	int16_t *sixteen_pointer;
-	uint8_t *eight_pointer;
-	float temp_float, vol;
-	struct hm_sample *cur_sample;
-	stb_vorbis *ogg;
-	for (i = 0; i < ctx->num_samples; i++) {
-		cur_sample = ctx->samples + i;
-		cur_sample->instrument_id = data[(*index)++];
-		cur_sample->ogg = data[(*index)++];
-
-		cur_sample->data_length = hm_read_32(data, index);
-		cur_sample->frame_count = hm_read_32(data, index);
-		cur_sample->sample_rate = hm_read_32(data, index);
-
-		cur_sample->sixteen_bit = data[(*index)++];
-		cur_sample->channels = data[(*index)++];
-		cur_sample->loop = data[(*index)++];
-
-		cur_sample->loop_start = hm_read_32(data, index);
-
-		temp_thirty_two = (((int32_t) hm_read_16(data, index)) - 32767);
-		cur_sample->pan = ((float) temp_thirty_two) / 32767.0f;
-		vol = ((float) hm_read_16(data, index)) / 65535.0f;
-
-		cur_sample->relative_note = data[(*index)++];
-		cur_sample->key_range_start = data[(*index)++];
-		cur_sample->key_range_end = data[(*index)++];
-		cur_sample->envelope = data[(*index)++];
-
-		cur_sample->predelay = hm_read_16(data, index)
-			* envelope_multiplier;
-		cur_sample->attack = hm_read_16(data, index)
-			* envelope_multiplier;
-		cur_sample->attack += cur_sample->predelay;
-		cur_sample->hold = hm_read_16(data, index)
-			* envelope_multiplier;
-		cur_sample->hold += cur_sample->attack;
-		cur_sample->decay = hm_read_16(data, index)
-			* envelope_multiplier;
-		cur_sample->decay += cur_sample->hold;
-
-		cur_sample->sustain = ((float) hm_read_16(data, index)) / 65535.0f;
-
-		cur_sample->fadeout = hm_read_16(data, index)
-			* envelope_multiplier;
-
-		cur_sample->frames = malloc(cur_sample->frame_count
-			* cur_sample->channels * sizeof(float));
-
-		if (cur_sample->ogg) {
-			ogg = stb_vorbis_open_memory(data + *index,
-				cur_sample->data_length, NULL, NULL);
-			stb_vorbis_get_samples_float_interleaved(ogg,
-				cur_sample->channels, cur_sample->frames,
-				cur_sample->frame_count
-				* cur_sample->channels);
-			stb_vorbis_close(ogg);
-			if (cur_sample->channels == 2) {
-				for (j = 0; j < cur_sample->frame_count; j++) {
-					cur_sample->frames[j * 2] *= vol;
-					cur_sample->frames[j * 2 + 1] *= vol;
-				}
-			} else {
-				for (j = 0; j < cur_sample->frame_count; j++) {
-					cur_sample->frames[j] *= vol;
-				}
-			}
-		} else if (cur_sample->sixteen_bit) {
-			sixteen_pointer = (int16_t *) (data + *index);
-			if (cur_sample->channels == 2) {
-				for (j = 0; j < cur_sample->frame_count; j++) {
-					cur_sample->frames[j * 2]
-						= ((float)
-						*sixteen_pointer++)
-						/ 32767.0f;
-					cur_sample->frames[j * 2] *= vol;
-					cur_sample->frames[j * 2 + 1]
-						= ((float)
-						*sixteen_pointer++)
-						/ 32767.0f;
-					cur_sample->frames[j * 2 + 1] *= vol;
-				}
-			} else {
-				for (j = 0; j < cur_sample->frame_count; j++) {
-					temp_float = (float) *sixteen_pointer++;
-					cur_sample->frames[j] = temp_float
-						/ 32767.0f;
-					cur_sample->frames[j] *= vol;
-				}
-			}
-		} else {
-			eight_pointer = (uint8_t *) (data + *index);
-			if (cur_sample->channels == 2) {
-				for (j = 0; j < cur_sample->frame_count; j++) {
-					temp_thirty_two = *eight_pointer++;
-					temp_thirty_two -= 128;
-					cur_sample->frames[j * 2]
-						= ((float) temp_thirty_two)
-						/ 128.0f;
-					cur_sample->frames[j * 2] *= vol;
-
-					temp_thirty_two = *eight_pointer++;
-					temp_thirty_two -= 128;
-					cur_sample->frames[j * 2 + 1]
-						= ((float) temp_thirty_two)
-						/ 128.0f;
-					cur_sample->frames[j * 2 + 1] *= vol;
-				}
-			} else {
-				for (j = 0; j < cur_sample->frame_count; j++) {
-					temp_thirty_two = *eight_pointer++;
-					temp_thirty_two -= 128;
-					cur_sample->frames[j]
-						= ((float) temp_thirty_two)
-						/ 128.0f;
-					cur_sample->frames[j] *= vol;
-				}
-			}
-		}
-		*index += cur_sample->data_length;
-	}
+	for (i = 0; i < level; i++)
+		frames += ((uint64_t) hm_mip_frames(sample, i)
+			+ HM_GUARD_FRAMES) * sample->channels;
+	view->frames = frames;
+	view->frame_count = hm_mip_frames(sample, level);
+	view->loop_start = sample->loop_start >> level;
+	view->loop = sample->loop;
+	view->channels = sample->channels;
 }
 
-int
-hm_create_context(struct hm_context **ctxp, const void *data,
-	uint32_t data_length, uint32_t rate)
+static void
+hm_fill_guard(const struct hm_sample *sample, float *frames)
 {
-	struct hm_context *ctx = NULL;
-	const uint8_t *info = (uint8_t *) data;
-	uint32_t i = 14;
+	const uint32_t loop_length = sample->frame_count - sample->loop_start;
+	float *guard = frames
+		+ (uint64_t) sample->frame_count * sample->channels;
+	uint32_t i;
 	int j;
-	uint8_t *mempool = calloc(1, sizeof(struct hm_context));
-	ctx = (*ctxp = (struct hm_context*) mempool);
-
-	ctx->rate = rate;
-	while (info[i]) {
-		ctx->name[i - 14] = info[i];
-		i++;
+	for (i = 0; i < HM_GUARD_FRAMES; i++) {
+		for (j = 0; j < sample->channels; j++) {
+			guard[i * sample->channels + j] = sample->loop
+				? frames[(sample->loop_start
+				+ i % loop_length) * sample->channels + j]
+				: 0.0f;
+		}
 	}
-	i++;
-
-	ctx->num_channels = info[i++];
-
-	ctx->num_samples = info[i++];
-	mempool = calloc(ctx->num_samples, sizeof(struct hm_sample));
-	ctx->samples = (struct hm_sample*) mempool;
-
-	ctx->bpm = info[i++];
-	ctx->subdivision = info[i++];
-
-	ctx->tick_length = ((ctx->rate * 60) / ctx->bpm) / ctx->subdivision;
-	ctx->tick_position = -1;
-	ctx->samples_left_in_tick = 0;
+}
 
-	ctx->length = hm_read_16(info, &i);
-	ctx->loop_position = hm_read_16(info, &i);
-	hm_load_samples(ctx, info, data_length, &i);
+static int64_t
+hm_wrap_frame(const struct hm_sample *sample, int64_t frame)
+{
+	return sample->loop_start + (frame - sample->frame_count)
+		% (sample->frame_count - sample->loop_start);
+}
 
-	mempool = malloc((data_length - i) * sizeof(uint8_t));
-	memcpy(mempool, info + i, (data_length - i));
-	ctx->data = mempool;
-	for (j = 0; j < ctx->num_channels; j++) {
-		ctx->channels[j].vol = 1.0f;
-		ctx->channels[j].sample_frame = -1;
+/* A frame from anywhere around a sample, as a filter near its edges sees it */
+static float
+hm_tap_frame(const struct hm_sample *sample, int64_t frame, int channel)
+{
+	if (frame < 0)
+		return 0.0f;
+	if (frame >= sample->frame_count) {
+		if (!sample->loop)
+			return 0.0f;
+		frame = hm_wrap_frame(sample, frame);
 	}
-	return 0;
+	return sample->frames[frame * sample->channels + channel];
 }
 
+/*
+ * Load conversions, each applying the sample's volume in the same pass.
+ * Frames stay interleaved as stored, so mono and stereo take the same
+ * loop. Where SSE2 is missing the plain loops are left to the compiler.
+ */
 static void
-hm_identify_sample(struct hm_context *ctx, struct hm_channel *channel,
-	uint8_t note, uint8_t instrument)
+hm_convert_u8(const uint8_t *restrict in, float *restrict out,
+	uint64_t count, float vol)
 {
-	int i;
-	for (i = 0; i < ctx->num_samples; i++) {
-		if (ctx->samples[i].instrument_id == instrument
-			&& note >= ctx->samples[i].key_range_start
-			&& note <= ctx->samples[i].key_range_end) {
-			channel->sample_id = i;
-			break;
-		}
+	const float scale = vol / 128.0f;
+	uint64_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 bias = _mm_set1_ps(128.0f);
+	const __m128 gain = _mm_set1_ps(scale);
+	__m128i bytes, words;
+	for (; i + 16 <= count; i += 16) {
+		bytes = _mm_loadu_si128((const __m128i *) (in + i));
+		words = _mm_unpacklo_epi8(bytes, zero);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(
+			_mm_unpacklo_epi16(words, zero)), bias), gain));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_sub_ps(
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero)),
+			bias), gain));
+		words = _mm_unpackhi_epi8(bytes, zero);
+		_mm_storeu_ps(out + i + 8, _mm_mul_ps(_mm_sub_ps(
+			_mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero)),
+			bias), gain));
+		_mm_storeu_ps(out + i + 12, _mm_mul_ps(_mm_sub_ps(
+			_mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero)),
+			bias), gain));
 	}
+#endif
+	for (; i < count; i++)
+		out[i] = ((int32_t) in[i] - 128) * scale;
+}
 
-	ctx->samples[channel->sample_id].envelope_timer = 0;
+/* Little-endian 16-bit PCM, at any alignment */
+static void
+hm_convert_s16(const uint8_t *restrict in, float *restrict out,
+	uint64_t count, float vol)
+{
+	const float scale = vol / 32767.0f;
+	uint64_t i = 0;
+#if defined(__SSE2__)
+	const __m128 gain = _mm_set1_ps(scale);
+	__m128i words;
+	for (; i + 8 <= count; i += 8) {
+		words = _mm_loadu_si128((const __m128i *) (in + i * 2));
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16)),
+			gain));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16)),
+			gain));
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = (int16_t) (in[i * 2] | in[i * 2 + 1] << 8) * scale;
 }
 
 static void
-hm_init_ramp(struct hm_ramp *ramp, uint32_t duration, int32_t start,
-	int32_t end)
+hm_scale_frames(float *frames, uint64_t count, float vol)
 {
-	ramp->enabled = 1;
-	ramp->frame_pos = 0;
-	ramp->frame_duration = duration;
-	ramp->start = start;
-	ramp->end = end;
+	uint64_t i = 0;
+#if defined(__SSE2__)
+	const __m128 gain = _mm_set1_ps(vol);
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_ps(frames + i,
+			_mm_mul_ps(_mm_loadu_ps(frames + i), gain));
+#endif
+	for (; i < count; i++)
+		frames[i] *= vol;
 }
 
 static void
-hm_process_command(struct hm_context *ctx, struct hm_channel *channel)
+hm_convert_source(const struct hm_sample *sample, const uint8_t *data,
+	float *out)
 {
-	int i;
-	int32_t temp_32;
-	struct hm_ramp *cur_ramp;
-	switch (channel->command_id & 15) {
-	case 1:
-		if (channel->command_id >> 4) {
-			hm_init_ramp(channel->ramps + 0,
-				((channel->command_id >> 4) + 1)
-				* ctx->tick_length,
-				(int32_t) (channel->vol * 255.0f),
-				channel->command_param);
-		} else {
-			channel->vol = ((float) channel->command_param)
-				/ 255.0f;
-			channel->ramps[0].enabled = 0;
-		}
-		break;
-	case 2:
-		if (channel->command_id >> 4) {
-			hm_init_ramp(channel->ramps + 1,
-				((channel->command_id >> 4) + 1)
-				* ctx->tick_length,
-				(int32_t) (channel->pan * 127.0f),
-				((int32_t) channel->command_param) - 127);
-		} else {
-			temp_32 = ((int32_t) channel->command_param) - 127;
-			channel->pan = ((float) temp_32) / 127.0f;
-			channel->ramps[1].enabled = 0;
-		}
-		break;
-	case 3:
-		if (channel->command_id >> 4) {
-			hm_init_ramp(channel->ramps + 2,
-				((channel->command_id >> 4) + 1)
-				* ctx->tick_length,
-				channel->coarse_detune,
-				((int32_t) channel->command_param) - 127);
-		} else {
-			channel->coarse_detune = ((int32_t) channel->command_param) - 127;
-			channel->ramps[2].enabled = 0;
-		}
-		break;
-	case 4:
-		if (channel->command_id >> 4) {
-			hm_init_ramp(channel->ramps + 3,
-				((channel->command_id >> 4) + 1)
-				* ctx->tick_length,
-				channel->fine_detune,
-				((int32_t) channel->command_param) - 127);
-		} else {
-			channel->fine_detune = ((int32_t) channel->command_param) - 127;
-			channel->ramps[3].enabled = 0;
+	const uint64_t count = (uint64_t) sample->source_frame_count
+		* sample->channels;
+	uint64_t decoded;
+	stb_vorbis *ogg;
+
+	if (sample->ogg) {
+		ogg = stb_vorbis_open_memory(data, sample->data_length,
+			NULL, NULL);
+		decoded = 0;
+		if (ogg) {
+			decoded = stb_vorbis_get_samples_float_interleaved(ogg,
+				sample->channels, out, count);
+			decoded *= sample->channels;
+			stb_vorbis_close(ogg);
 		}
-		break;
-	case 5:
-		channel->predelay = channel->command_param;
-		break;
-	case 6:
-		channel->trills[0].enabled = channel->command_id >> 4 & 1;
-		channel->trills[0].depth = channel->command_param & 15;
-		channel->trills[0].frame_length = (ctx->rate / 100)
-			* (channel->command_param >> 4);
-		channel->trills[0].frame_pos = channel->trills[0].frame_length;
-		break;
-	case 7:
-		channel->trills[1].enabled = channel->command_id >> 4;
-		channel->trills[1].depth = channel->command_param & 15 + 10;
-		channel->trills[1].frame_length = (ctx->rate / 100)
-			* (channel->command_param >> 4);
-		channel->trills[1].frame_pos = channel->trills[1].frame_length;
-		break;
+		/* Streams shorter than frame_count end in silence */
+		if (decoded < count)
+			memset(out + decoded, 0, (count - decoded)
+				* sizeof(float));
+		hm_scale_frames(out, count, sample->vol);
+	} else if (sample->sixteen_bit) {
+		hm_convert_s16(data, out, count, sample->vol);
+	} else {
+		hm_convert_u8(data, out, count, sample->vol);
 	}
 }
 
-static void
-hm_loop(struct hm_context *ctx)
+static float
+hm_source_frame(const struct hm_sample *sample, const float *source,
+	int64_t index, int channel)
 {
-	int i, j;
-	ctx->tick_position = ctx->loop_position;
-	for (i = 0; i < ctx->num_channels; i++)
-		for (j = 0; j < 4; j++)
-			ctx->channels[i].ramps[j].enabled = 0;
+	const int64_t count = sample->source_frame_count;
+	if (index < 0)
+		return 0.0f;
+	if (index >= count) {
+		if (!sample->loop)
+			return 0.0f;
+		index = sample->source_loop_start + (index - count)
+			% (count - sample->source_loop_start);
+	}
+	return source[index * sample->channels + channel];
 }
 
-static void
-hm_load_new_tick(struct hm_context *ctx)
+/* sinc(x) under a Blackman window that closes at x = +-half */
+static double
+hm_blackman_sinc(double x, double half)
 {
-	int i;
-	uint8_t instrument_id;
-	uint8_t requested_note;
-	uint32_t data_index;
-	struct hm_channel *channel;
-	ctx->tick_position++;
-	if (ctx->tick_position >= ctx->length)
-		hm_loop(ctx);
-
-	data_index = 4 * ctx->num_channels * ctx->tick_position;
-	for (i = 0; i < ctx->num_channels; i++) {
-		channel = ctx->channels + i;
-		if (ctx->data[data_index] >> 7) {
-			requested_note = ctx->data[data_index] & 127;
-
-			instrument_id = ctx->data[data_index + 1];
+	const double sinc = x == 0.0 ? 1.0 : sin(HM_PI * x) / (HM_PI * x);
+	return sinc * (0.42 + 0.5 * cos(HM_PI * x / half)
+		+ 0.08 * cos(2.0 * HM_PI * x / half));
+}
 
-			if (requested_note) {
-				requested_note--;
-				hm_identify_sample(ctx, channel,
-					requested_note, instrument_id);
-				channel->base_note = requested_note;
+/*
+ * Blackman windowed sinc conversion of a decoded sample to its new rate.
+ * Reads past the end go through the loop, so loops stay seamless.
+ */
+static int
+hm_resample(const struct hm_sample *sample, const float *source, float *out)
+{
+	const double step = (double) sample->source_rate / sample->sample_rate;
+	const double cutoff = step > 1.0 ? 1.0 / step : 1.0;
+	const double width = HM_RESAMPLE_TAPS / cutoff;
+	const uint32_t table_length = HM_RESAMPLE_TAPS * HM_RESAMPLE_PHASES;
+	float *table = malloc((table_length + 2) * sizeof(float));
+	double t, x, weight, weight_sum, acc[2];
+	int64_t k, first, last;
+	uint32_t i, entry;
+	int c;
 
-				channel->key_off = 0;
+	if (!table)
+		return -1;
+	table[0] = 1.0f;
+	for (i = 1; i <= table_length; i++) {
+		x = (double) i / HM_RESAMPLE_PHASES;
+		table[i] = hm_blackman_sinc(x, HM_RESAMPLE_TAPS);
+	}
+	table[table_length] = table[table_length + 1] = 0.0f;
 
-				channel->coarse_detune = 0;
-				channel->fine_detune = 0;
-				channel->predelay = 0;
-				channel->fadeout_timer = 0;
+	for (i = 0; i < sample->frame_count; i++) {
+		t = i * step;
+		first = (int64_t) ceil(t - width);
+		last = (int64_t) floor(t + width);
+		weight_sum = acc[0] = acc[1] = 0.0;
+		for (k = first; k <= last; k++) {
+			x = fabs(t - k) * cutoff * HM_RESAMPLE_PHASES;
+			entry = (uint32_t) x;
+			if (entry >= table_length)
+				continue;
+			weight = table[entry] + (x - entry)
+				* (table[entry + 1] - table[entry]);
+			weight_sum += weight;
+			for (c = 0; c < sample->channels; c++)
+				acc[c] += weight
+					* hm_source_frame(sample, source, k, c);
+		}
+		for (c = 0; c < sample->channels; c++)
+			out[i * sample->channels + c] = weight_sum != 0.0
+				? acc[c] / weight_sum : 0.0;
+	}
+	free(table);
+	return 0;
+}
+
+/*
+ * Fills a level of a sample's copies from the level above: a half-band
+ * windowed sinc, then every other frame. Reads past the end go through the
+ * loop, so loops stay seamless.
+ */
+static void
+hm_decimate(const struct hm_sample *sample, float *frames, int level)
+{
+	double weight[HM_MIPMAP_TAPS * 2 + 1], sum = 0.0, acc;
+	struct hm_sample above, below;
+	uint32_t j;
+	int k, c;
+
+	hm_mip_view(sample, frames, level - 1, &above);
+	hm_mip_view(sample, frames, level, &below);
+	for (k = -HM_MIPMAP_TAPS; k <= HM_MIPMAP_TAPS; k++) {
+		weight[k + HM_MIPMAP_TAPS] = hm_blackman_sinc(k * 0.5,
+			(HM_MIPMAP_TAPS + 1) * 0.5);
+		sum += weight[k + HM_MIPMAP_TAPS];
+	}
+	for (j = 0; j < below.frame_count; j++) {
+		for (c = 0; c < sample->channels; c++) {
+			acc = 0.0;
+			for (k = -HM_MIPMAP_TAPS; k <= HM_MIPMAP_TAPS; k++)
+				acc += weight[k + HM_MIPMAP_TAPS]
+					* hm_tap_frame(&above,
+					(int64_t) j * 2 + k, c);
+			below.frames[j * sample->channels + c] = acc / sum;
+		}
+	}
+	hm_fill_guard(&below, below.frames);
+}
+
+/*
+ * Decodes a sample into a new buffer of hm_sample_size bytes and finds its
+ * largest magnitude. It only reads what loading set, so the prefetch
+ * thread can call it while the sample plays. NULL when out of memory.
+ */
+static float *
+hm_decode_frames(const struct hm_sample *sample, const uint8_t *data,
+	float *peak)
+{
+	float *frames, *source;
+	uint64_t i;
+
+	frames = malloc(hm_sample_size(sample));
+	if (!frames)
+		return NULL;
+
+	if (sample->resampled) {
+		source = malloc((uint64_t) sample->source_frame_count
+			* sample->channels * sizeof(float));
+		if (source) {
+			hm_convert_source(sample, data, source);
+			if (hm_resample(sample, source, frames)) {
+				free(source);
+				source = NULL;
+			}
+		}
+		if (!source) {
+			free(frames);
+			return NULL;
+		}
+		free(source);
+	} else {
+		hm_convert_source(sample, data, frames);
+	}
+	hm_fill_guard(sample, frames);
+	for (i = 1; i <= sample->mip_levels; i++)
+		hm_decimate(sample, frames, i);
+
+	*peak = 0.0f;
+	for (i = 0; i < (uint64_t) sample->frame_count * sample->channels;
+		i++)
+		if (fabsf(frames[i]) > *peak)
+			*peak = fabsf(frames[i]);
+	return frames;
+}
+
+/* Everything decoded frames depend on, compared whole */
+struct hm_share_key {
+	uint64_t hash;
+	uint32_t data_length;
+	uint32_t source_frame_count;
+	uint32_t source_rate;
+	uint32_t frame_count;
+	uint32_t sample_rate;
+	uint32_t loop_start;
+	float vol;
+	uint8_t ogg;
+	uint8_t sixteen_bit;
+	uint8_t channels;
+	uint8_t loop;
+	uint8_t resampled;
+	uint8_t mip_levels;
+};
+
+struct hm_shared_frames {
+	struct hm_share_key key;
+	uint8_t *data; // The packed data, compared on a hit
+	float *frames;
+	float peak;
+	uint32_t refs;
+	struct hm_shared_frames *next;
+};
+
+/* One cache for the process, as the header is compiled once */
+static struct hm_shared_frames *hm_shared[HM_SHARE_BUCKETS];
+#ifndef HM_NO_THREADS
+static pthread_mutex_t hm_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+hm_lock_shared(void)
+{
+#ifndef HM_NO_THREADS
+	pthread_mutex_lock(&hm_shared_lock);
+#endif
+}
+
+static void
+hm_unlock_shared(void)
+{
+#ifndef HM_NO_THREADS
+	pthread_mutex_unlock(&hm_shared_lock);
+#endif
+}
+
+/* FNV-1a */
+static uint64_t
+hm_hash(const uint8_t *data, uint32_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	uint32_t i;
+	for (i = 0; i < length; i++)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static void
+hm_share_key(const struct hm_sample *sample, struct hm_share_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->hash = sample->share_hash;
+	key->data_length = sample->data_length;
+	key->source_frame_count = sample->source_frame_count;
+	key->source_rate = sample->source_rate;
+	key->frame_count = sample->frame_count;
+	key->sample_rate = sample->sample_rate;
+	key->loop_start = sample->loop_start;
+	key->vol = sample->vol;
+	key->ogg = sample->ogg;
+	key->sixteen_bit = sample->sixteen_bit;
+	key->channels = sample->channels;
+	key->loop = sample->loop;
+	key->resampled = sample->resampled;
+	key->mip_levels = sample->mip_levels;
+}
+
+/* The link to the entry decoded from data, or the end of its bucket */
+static struct hm_shared_frames **
+hm_find_shared(const struct hm_share_key *key, const uint8_t *data)
+{
+	struct hm_shared_frames **link = &hm_shared[key->hash
+		% HM_SHARE_BUCKETS];
+	while (*link && (memcmp(&(*link)->key, key, sizeof(*key))
+		|| memcmp((*link)->data, data, key->data_length)))
+		link = &(*link)->next;
+	return link;
+}
+
+/*
+ * Decoded frames for a sample, taking a reference on the shared copy for
+ * shared samples. Decoding happens outside the lock, so two threads may
+ * decode the same sample at once, and the second copy is thrown away.
+ */
+static float *
+hm_obtain_frames(const struct hm_sample *sample, const uint8_t *data,
+	float *peak)
+{
+	struct hm_shared_frames **link, *entry;
+	struct hm_share_key key;
+	uint8_t *packed;
+	float *frames;
+
+	if (!sample->shared)
+		return hm_decode_frames(sample, data, peak);
+	hm_share_key(sample, &key);
+	hm_lock_shared();
+	entry = *hm_find_shared(&key, data);
+	if (!entry) {
+		hm_unlock_shared();
+		frames = hm_decode_frames(sample, data, peak);
+		entry = frames ? calloc(1, sizeof(*entry)) : NULL;
+		packed = entry ? malloc(key.data_length ? key.data_length : 1)
+			: NULL;
+		if (!packed) {
+			free(frames);
+			free(entry);
+			return NULL;
+		}
+		memcpy(packed, data, key.data_length);
+		hm_lock_shared();
+		link = hm_find_shared(&key, data);
+		if (*link) {
+			free(frames);
+			free(packed);
+			free(entry);
+			entry = *link;
+		} else {
+			entry->key = key;
+			entry->data = packed;
+			entry->frames = frames;
+			entry->peak = *peak;
+			*link = entry;
+		}
+	}
+	entry->refs++;
+	*peak = entry->peak;
+	frames = entry->frames;
+	hm_unlock_shared();
+	return frames;
+}
+
+/*
+ * Takes count references off the cache's copy of frames. Frames the cache
+ * doesn't hold were decoded for the sample alone and are freed.
+ */
+static void
+hm_drop_shared(const struct hm_sample *sample, float *frames, uint32_t count)
+{
+	struct hm_shared_frames **link, *entry;
+
+	hm_lock_shared();
+	link = &hm_shared[sample->share_hash % HM_SHARE_BUCKETS];
+	while (*link && (*link)->frames != frames)
+		link = &(*link)->next;
+	entry = *link;
+	if (entry && !(entry->refs -= count)) {
+		*link = entry->next;
+		free(entry->frames);
+		free(entry->data);
+		free(entry);
+	}
+	hm_unlock_shared();
+	if (!entry)
+		free(frames);
+}
+
+/* Gives back frames from hm_obtain_frames or hm_decode_frames */
+static void
+hm_drop_frames(const struct hm_sample *sample, float *frames)
+{
+	if (sample->baked)
+		return;
+	if (!sample->shared || !frames) {
+		free(frames);
+		return;
+	}
+	hm_drop_shared(sample, frames, 1);
+}
+
+/*
+ * Gives back frames on the render thread, which mustn't wait on the
+ * cache's lock. Its own frames are freed, and references on the cache are
+ * left for hm_collect_frames.
+ */
+static void
+hm_retire_frames(struct hm_sample *sample, float *frames, int cached)
+{
+#ifndef HM_NO_THREADS
+	if (cached) {
+		atomic_store(&sample->retired_frames, frames);
+		atomic_fetch_add(&sample->retired, 1);
+		return;
+	}
+#endif
+	hm_drop_frames(sample, frames);
+}
+
+/*
+ * Gives back what the render thread retired. Every retired reference of a
+ * sample is on the same copy, as the cache hands that copy out again for
+ * as long as one of them holds it.
+ */
+static void
+hm_collect_frames(struct hm_context *ctx)
+{
+	uint32_t count;
+	int i;
+	for (i = 0; i < ctx->num_samples; i++) {
+		count = atomic_exchange(&ctx->samples[i].retired, 0);
+		if (count)
+			hm_drop_shared(ctx->samples + i, atomic_load(
+				&ctx->samples[i].retired_frames), count);
+	}
+}
+
+static int
+hm_decode_sample(struct hm_sample *sample, const uint8_t *data)
+{
+	sample->frames = hm_obtain_frames(sample, data, &sample->peak);
+	sample->cached = sample->shared;
+	return sample->frames ? 0 : -1;
+}
+
+/*
+ * Whether a sample's settings describe data it can decode: mono or
+ * stereo, and no more PCM frames than its data holds.
+ */
+static int
+hm_check_sample(const struct hm_sample *sample)
+{
+	if (sample->channels != 1 && sample->channels != 2)
+		return -1;
+	if (!sample->ogg && (uint64_t) sample->frame_count * sample->channels
+		* (sample->sixteen_bit ? 2 : 1) > sample->data_length)
+		return -1;
+	return 0;
+}
+
+/* Turns the envelope's stored lengths into frames at rate */
+static void
+hm_scale_envelope(struct hm_sample *sample, uint32_t rate)
+{
+	const float envelope_multiplier = (float) rate / 1000.0f;
+	sample->predelay = sample->envelope_ms[0] * envelope_multiplier;
+	sample->attack = sample->envelope_ms[1] * envelope_multiplier;
+	sample->attack += sample->predelay;
+	sample->hold = sample->envelope_ms[2] * envelope_multiplier;
+	sample->hold += sample->attack;
+	sample->decay = sample->envelope_ms[3] * envelope_multiplier;
+	sample->decay += sample->hold;
+	sample->fadeout = sample->envelope_ms[4] * envelope_multiplier;
+}
+
+/* Reads the HM_SAMPLE_HEADER_SIZE bytes of settings before the data */
+static void
+hm_load_sample(struct hm_context *ctx, struct hm_sample *cur_sample,
+	const uint8_t *data, uint32_t *index)
+{
+	int32_t temp_thirty_two;
+	int j;
+
+	cur_sample->instrument_id = data[(*index)++];
+	cur_sample->ogg = data[(*index)++];
+
+	cur_sample->data_length = hm_read_32(data, index);
+	cur_sample->frame_count = hm_read_32(data, index);
+	cur_sample->sample_rate = hm_read_32(data, index);
+
+	cur_sample->sixteen_bit = data[(*index)++];
+	cur_sample->channels = data[(*index)++];
+	cur_sample->loop = data[(*index)++];
+
+	cur_sample->loop_start = hm_read_32(data, index);
+	if (!cur_sample->frame_count)
+		cur_sample->loop = 0;
+	else if (cur_sample->loop_start >= cur_sample->frame_count)
+		cur_sample->loop_start = 0;
+
+	temp_thirty_two = (((int32_t) hm_read_16(data, index)) - 32767);
+	cur_sample->pan = ((float) temp_thirty_two) / 32767.0f;
+	cur_sample->vol = ((float) hm_read_16(data, index)) / 65535.0f;
+	cur_sample->gain = 1.0f;
+
+	cur_sample->relative_note = data[(*index)++];
+	cur_sample->key_range_start = data[(*index)++];
+	cur_sample->key_range_end = data[(*index)++];
+	cur_sample->envelope = data[(*index)++];
+
+	for (j = 0; j < 4; j++)
+		cur_sample->envelope_ms[j] = hm_read_16(data, index);
+	cur_sample->sustain = ((float) hm_read_16(data, index)) / 65535.0f;
+	cur_sample->envelope_ms[4] = hm_read_16(data, index);
+	hm_scale_envelope(cur_sample, ctx->rate);
+
+	cur_sample->peak = -1.0f;
+	cur_sample->source_frame_count = cur_sample->frame_count;
+	cur_sample->source_rate = cur_sample->sample_rate;
+	cur_sample->source_loop_start = cur_sample->loop_start;
+}
+
+static int
+hm_load_samples(struct hm_context *ctx, const uint8_t *data,
+	uint32_t data_length, uint32_t *index)
+{
+	int i;
+	struct hm_sample *cur_sample;
+	for (i = 0; i < ctx->num_samples; i++) {
+		cur_sample = ctx->samples + i;
+		if (*index > data_length
+			|| data_length - *index < HM_SAMPLE_HEADER_SIZE)
+			return -1;
+		hm_load_sample(ctx, cur_sample, data, index);
+		if (hm_check_sample(cur_sample)
+			|| data_length - *index < cur_sample->data_length)
+			return -1;
+		cur_sample->data_offset = *index;
+		atomic_store(&cur_sample->loaded, 1);
+		*index += cur_sample->data_length;
+	}
+	return 0;
+}
+
+/* Looks up key ranges in params when given, the samples' own otherwise */
+static uint16_t
+hm_find_sample(const struct hm_context *ctx,
+	const struct hm_sample_params *params, uint8_t note, uint8_t instrument)
+{
+	int i;
+	for (i = 0; i < ctx->num_samples; i++) {
+		if (ctx->samples[i].instrument_id == instrument
+			&& note >= (params ? params[i].key_range_start
+			: ctx->samples[i].key_range_start)
+			&& note <= (params ? params[i].key_range_end
+			: ctx->samples[i].key_range_end)) {
+			return i;
+		}
+	}
+	return HM_NO_SAMPLE;
+}
+
+static void
+hm_compile_command(struct hm_event *event)
+{
+	const uint8_t param = event->command_param;
+	event->command = event->command_id & 15;
+	event->modifier = event->command_id >> 4;
+	switch (event->command) {
+	case 1:
+		event->target = param;
+		event->level = ((float) param) / 255.0f;
+		break;
+	case 2:
+		event->target = ((int32_t) param) - 127;
+		event->level = ((float) event->target) / 127.0f;
+		break;
+	case 3:
+	case 4:
+		event->target = ((int32_t) param) - 127;
+		break;
+	case 5:
+		event->target = param;
+		break;
+	case 6:
+		event->target = param & 15;
+		event->period = param >> 4;
+		break;
+	case 7:
+		event->target = param & 15 + 10;
+		event->period = param >> 4;
+		break;
+	}
+}
+
+/*
+ * Turns length ticks of raw pattern into a list of the cells that do
+ * something, grouped by tick, with sample lookups and command parameters
+ * resolved up front.
+ */
+static int
+hm_compile_cells(const struct hm_context *ctx, const uint8_t *data,
+	uint16_t length, const struct hm_sample_params *params,
+	struct hm_event **events, uint32_t **tick_events)
+{
+	uint32_t tick, count = 0, cell_count;
+	uint32_t i;
+	const uint8_t *cell;
+	struct hm_event *event;
+
+	cell_count = (uint32_t) length * ctx->num_channels;
+	for (i = 0; i < cell_count; i++) {
+		cell = data + i * 4;
+		if (cell[0] >> 7 || cell[2])
+			count++;
+	}
+
+	*events = calloc(count ? count : 1, sizeof(struct hm_event));
+	*tick_events = malloc((length + 1) * sizeof(uint32_t));
+	if (!*events || !*tick_events)
+		return -1;
+
+	event = *events;
+	for (tick = 0; tick < length; tick++) {
+		(*tick_events)[tick] = event - *events;
+		for (i = 0; i < ctx->num_channels; i++) {
+			cell = data + (tick * ctx->num_channels + i) * 4;
+			if (!(cell[0] >> 7 || cell[2]))
+				continue;
+
+			event->channel = i;
+			if (cell[0] >> 7) {
+				if (cell[0] & 127) {
+					event->flags |= HM_EVENT_NOTE;
+					event->note = (cell[0] & 127) - 1;
+					event->sample_id = hm_find_sample(ctx,
+						params, event->note, cell[1]);
+				} else {
+					event->flags |= HM_EVENT_KEY_OFF;
+				}
+			}
+			if (cell[2]) {
+				event->flags |= HM_EVENT_COMMAND;
+				event->command_id = cell[2];
+				event->command_param = cell[3];
+				hm_compile_command(event);
+			}
+			event++;
+		}
+	}
+	(*tick_events)[length] = event - *events;
+	return 0;
+}
+
+static int
+hm_compile_pattern(struct hm_context *ctx)
+{
+	return hm_compile_cells(ctx, ctx->data, ctx->length, NULL,
+		&ctx->events, &ctx->tick_events);
+}
+
+/*
+ * Flags samples that may play at anything but their root pitch: notes away
+ * from relative_note, or channels that use detune or trill commands.
+ */
+static void
+hm_find_transposed(struct hm_context *ctx, uint8_t *transposed)
+{
+	uint8_t detuned[HM_MAX_CHANNELS] = { 0 };
+	const struct hm_event *event;
+	const struct hm_event *end = ctx->events
+		+ ctx->tick_events[ctx->length];
+	uint16_t sample_id;
+
+	for (event = ctx->events; event < end; event++) {
+		if (event->flags & HM_EVENT_COMMAND && (event->command == 3
+			|| event->command == 4 || event->command == 6
+			|| event->command == 7))
+			detuned[event->channel] = 1;
+		/* Notes that keep the last sample could land on any of them */
+		if (event->flags & HM_EVENT_NOTE
+			&& event->sample_id == HM_NO_SAMPLE)
+			detuned[event->channel] = 1;
+	}
+	for (event = ctx->events; event < end; event++) {
+		if (!(event->flags & HM_EVENT_NOTE)
+			|| event->sample_id == HM_NO_SAMPLE)
+			continue;
+		sample_id = event->sample_id;
+		if (detuned[event->channel] || event->note
+			!= ctx->samples[sample_id].relative_note)
+			transposed[sample_id] = 1;
+	}
+}
+
+static void
+hm_plan_resampling(struct hm_context *ctx, uint32_t flags)
+{
+	uint8_t *transposed = calloc(ctx->num_samples ? ctx->num_samples : 1,
+		1);
+	struct hm_sample *cur_sample;
+	double ratio, loop_length;
+	int i;
+
+	if (!transposed)
+		return;
+	if (!(flags & HM_RESAMPLE))
+		hm_find_transposed(ctx, transposed);
+	for (i = 0; i < ctx->num_samples; i++) {
+		cur_sample = ctx->samples + i;
+		if (transposed[i] || !cur_sample->source_rate
+			|| cur_sample->source_rate == ctx->rate)
+			continue;
+		ratio = (double) ctx->rate / cur_sample->source_rate;
+		/* Loops that would come out a fraction of a frame long drift */
+		loop_length = (cur_sample->source_frame_count
+			- cur_sample->source_loop_start) * ratio;
+		if (cur_sample->loop
+			&& fabs(loop_length - floor(loop_length + 0.5)) > 1e-6)
+			continue;
+		cur_sample->frame_count = cur_sample->source_frame_count
+			* ratio + 0.5;
+		cur_sample->loop_start = cur_sample->source_loop_start
+			* ratio + 0.5;
+		if (cur_sample->loop_start >= cur_sample->frame_count)
+			cur_sample->loop_start = 0;
+		if (!cur_sample->frame_count)
+			cur_sample->loop = 0;
+		cur_sample->sample_rate = ctx->rate;
+		cur_sample->resampled = 1;
+	}
+	free(transposed);
+}
+
+/*
+ * Gives a sample as many copies as it has octaves to spare, stopping where
+ * a loop would no longer split into whole frames.
+ */
+static void
+hm_plan_mipmaps(struct hm_sample *sample)
+{
+	uint8_t levels = 0;
+	while (levels < HM_MIPMAP_LEVELS && (sample->frame_count
+		>> (levels + 1)) >= HM_MIPMAP_MIN_FRAMES) {
+		if (sample->loop && (sample->loop_start | sample->frame_count)
+			& ((2u << levels) - 1))
+			break;
+		levels++;
+	}
+	sample->mip_levels = levels;
+}
+
+/* Decides how each sample will be laid out once decoded */
+static void
+hm_plan_samples(struct hm_context *ctx, uint32_t flags)
+{
+	int i;
+	if (flags & (HM_RESAMPLE | HM_RESAMPLE_FIXED))
+		hm_plan_resampling(ctx, flags);
+	for (i = 0; i < ctx->num_samples; i++) {
+		if (flags & HM_MIPMAP)
+			hm_plan_mipmaps(ctx->samples + i);
+		ctx->samples[i].shared = !!(flags & HM_SHARE_SAMPLES);
+	}
+}
+
+/* Whether a sample stays packed until a voice needs it */
+static int
+hm_keep_packed(const struct hm_context *ctx, const struct hm_sample *sample)
+{
+	return ctx->sample_budget && (sample->ogg
+		|| ctx->flags & HM_PACK_PCM);
+}
+
+/*
+ * With a budget, OGG samples (and PCM ones when asked to) stay packed and
+ * are only decoded when a voice needs them. The rest are decoded now.
+ * -1 when out of memory or a sample fails to decode.
+ */
+static int
+hm_decode_samples(struct hm_context *ctx, const uint8_t *data,
+	const struct hm_load_options *options)
+{
+	struct hm_sample *cur_sample;
+	int i;
+	hm_plan_samples(ctx, options->flags);
+	for (i = 0; i < ctx->num_samples; i++) {
+		cur_sample = ctx->samples + i;
+		if (cur_sample->shared)
+			cur_sample->share_hash = hm_hash(data
+				+ cur_sample->data_offset,
+				cur_sample->data_length);
+		if (hm_keep_packed(ctx, cur_sample)) {
+			cur_sample->source = malloc(cur_sample->data_length
+				? cur_sample->data_length : 1);
+			if (!cur_sample->source)
+				return -1;
+			memcpy(cur_sample->source,
+				data + cur_sample->data_offset,
+				cur_sample->data_length);
+		} else if (hm_decode_sample(cur_sample,
+			data + cur_sample->data_offset)) {
+			return -1;
+		} else {
+			ctx->sample_memory += hm_sample_size(cur_sample);
+		}
+	}
+	return 0;
+}
+
+static int
+hm_check_baked(const struct hm_context *ctx, const uint8_t *data,
+	uint32_t data_length, const struct hm_load_options *options)
+{
+	const struct hm_baked_header *header = options->baked;
+	const struct hm_baked_sample *table;
+	struct hm_sample layout;
+	uint64_t end;
+	int i;
+
+	if (options->baked_length < sizeof(*header)
+		|| (uintptr_t) header % sizeof(uint64_t)
+		|| header->magic != HM_BAKED_MAGIC
+		|| header->version != HM_BAKED_VERSION
+		|| header->event_size != sizeof(struct hm_event)
+		|| header->source_length != data_length
+		|| header->rate != ctx->rate
+		|| header->flags != (options->flags & HM_BAKED_FLAGS)
+		|| header->num_samples != ctx->num_samples
+		|| header->length != ctx->length)
+		return -1;
+	end = sizeof(*header) + ctx->num_samples * sizeof(*table)
+		+ (ctx->length + 1) * sizeof(uint32_t)
+		+ (uint64_t) header->event_count * sizeof(struct hm_event);
+	if (end > options->baked_length)
+		return -1;
+
+	table = (const struct hm_baked_sample *) (header + 1);
+	for (i = 0; i < ctx->num_samples; i++) {
+		memset(&layout, 0, sizeof(layout));
+		layout.frame_count = table[i].frame_count;
+		layout.channels = table[i].channels;
+		layout.mip_levels = table[i].mip_levels;
+		if (table[i].channels != ctx->samples[i].channels
+			|| table[i].size != hm_sample_size(&layout)
+			|| table[i].offset % HM_BAKED_ALIGN
+			|| table[i].offset < end
+			|| table[i].size > options->baked_length
+			|| table[i].offset > options->baked_length
+			- table[i].size)
+			return -1;
+	}
+	/* Last, as it reads the whole module */
+	return header->source_hash == hm_hash(data, data_length) ? 0 : -1;
+}
+
+/*
+ * Takes the compiled pattern and decoded samples from a baked file in
+ * place of compiling and decoding them, when it was baked from this
+ * module with the same rate and options.
+ */
+static int
+hm_load_baked(struct hm_context *ctx, const uint8_t *data,
+	uint32_t data_length, const struct hm_load_options *options)
+{
+	const struct hm_baked_header *header = options->baked;
+	const struct hm_baked_sample *table;
+	const uint32_t *tick_events;
+	struct hm_sample *cur_sample;
+	int i;
+
+	if (hm_check_baked(ctx, data, data_length, options))
+		return -1;
+	table = (const struct hm_baked_sample *) (header + 1);
+	tick_events = (const uint32_t *) (table + ctx->num_samples);
+	if (tick_events[ctx->length] != header->event_count)
+		return -1;
+	ctx->events = malloc(header->event_count
+		? header->event_count * sizeof(struct hm_event) : 1);
+	ctx->tick_events = malloc((ctx->length + 1) * sizeof(uint32_t));
+	if (!ctx->events || !ctx->tick_events)
+		return -1;
+	memcpy(ctx->tick_events, tick_events,
+		(ctx->length + 1) * sizeof(uint32_t));
+	memcpy(ctx->events, tick_events + ctx->length + 1,
+		header->event_count * sizeof(struct hm_event));
+
+	for (i = 0; i < ctx->num_samples; i++) {
+		cur_sample = ctx->samples + i;
+		cur_sample->frame_count = table[i].frame_count;
+		cur_sample->sample_rate = table[i].sample_rate;
+		cur_sample->loop = table[i].loop;
+		cur_sample->loop_start = table[i].loop_start;
+		cur_sample->resampled = table[i].resampled;
+		cur_sample->mip_levels = table[i].mip_levels;
+		cur_sample->peak = table[i].peak;
+		cur_sample->frames = (float *) ((const uint8_t *) header
+			+ table[i].offset);
+		cur_sample->baked = 1;
+	}
+	return 0;
+}
+
+static uint32_t
+hm_tick_length(const struct hm_context *ctx, uint32_t rate)
+{
+	return ((rate * 60) / ctx->bpm) / ctx->subdivision;
+}
+
+/*
+ * Sets up the master bus filter for mixing at rate and playing at
+ * output_rate: a windowed sinc cut off below the lower Nyquist frequency
+ * of the two, one row of taps per phase, each row summing to 1. reset
+ * empties the bus, for when what's in it was mixed at another rate.
+ */
+static int
+hm_setup_bus(struct hm_context *ctx, int reset)
+{
+	const int taps = HM_UPSAMPLE_TAPS * 2;
+	double cutoff, x, weight, sum;
+	float *row;
+	int phase, k;
+
+	if (ctx->rate == ctx->output_rate) {
+		free(ctx->bus_filter);
+		ctx->bus_filter = NULL;
+		return 0;
+	}
+	if (!ctx->bus_filter) {
+		ctx->bus_filter = malloc((HM_UPSAMPLE_PHASES + 1) * taps
+			* sizeof(float));
+		if (!ctx->bus_filter)
+			return -1;
+		reset = 1;
+	}
+
+	/* Leaves room for the transition band below Nyquist */
+	cutoff = ctx->output_rate < ctx->rate
+		? 0.9 * ctx->output_rate / ctx->rate : 0.9;
+	for (phase = 0; phase <= HM_UPSAMPLE_PHASES; phase++) {
+		row = ctx->bus_filter + phase * taps;
+		sum = 0.0;
+		for (k = 0; k < taps; k++) {
+			x = (double) phase / HM_UPSAMPLE_PHASES
+				+ HM_UPSAMPLE_TAPS - 1 - k;
+			weight = hm_blackman_sinc(x * cutoff,
+				HM_UPSAMPLE_TAPS * cutoff);
+			row[k] = weight;
+			sum += weight;
+		}
+		for (k = 0; k < taps; k++)
+			row[k] /= sum;
+	}
+
+	ctx->bus_step = (double) ctx->rate / ctx->output_rate;
+	if (reset) {
+		memset(ctx->bus, 0, sizeof(ctx->bus));
+		ctx->bus_frames = HM_UPSAMPLE_TAPS - 1;
+		ctx->bus_position = HM_UPSAMPLE_TAPS - 1;
+	}
+	return 0;
+}
+
+/* Sets up a context from the module header, up to the first sample */
+static int
+hm_new_context(struct hm_context **ctxp, const uint8_t *info,
+	uint32_t rate, const struct hm_load_options *options, uint32_t *index)
+{
+	struct hm_context *ctx = NULL;
+	uint32_t i = 14;
+	uint8_t *mempool = calloc(1, sizeof(struct hm_context));
+	ctx = (*ctxp = (struct hm_context*) mempool);
+	if (!ctx)
+		return -1;
+
+	ctx->output_rate = rate;
+	ctx->rate = options->mix_rate ? options->mix_rate : rate;
+	ctx->sample_budget = options->sample_budget;
+	ctx->flags = options->flags;
+	while (info[i]) {
+		ctx->name[i - 14] = info[i];
+		i++;
+	}
+	i++;
+
+	ctx->num_channels = info[i++];
+
+	ctx->num_samples = info[i++];
+	mempool = calloc(ctx->num_samples, sizeof(struct hm_sample));
+	ctx->samples = (struct hm_sample*) mempool;
+
+	ctx->bpm = info[i++];
+	ctx->subdivision = info[i++];
+
+	ctx->tick_length = hm_tick_length(ctx, ctx->rate);
+	ctx->tick_position = -1;
+	ctx->samples_left_in_tick = 0;
+
+	ctx->length = hm_read_16(info, &i);
+	ctx->loop_position = hm_read_16(info, &i);
+	*index = i;
+	if (ctx->samples || !ctx->num_samples)
+		return 0;
+	free(ctx);
+	*ctxp = NULL;
+	return -1;
+}
+
+/* Readies a loaded context to play from the start */
+static int
+hm_start_context(struct hm_context *ctx)
+{
+	int j;
+	for (j = 0; j < ctx->num_channels; j++) {
+		ctx->channels[j].vol = 1.0f;
+		ctx->channels[j].sample_frame = -1;
+	}
+	ctx->interpolation = HM_INTERPOLATE_LINEAR;
+	ctx->control_frames = 1;
+	ctx->voice_limit = ctx->num_channels;
+	return hm_setup_bus(ctx, 1);
+}
+
+static void
+hm_stop_loading(struct hm_context *ctx)
+{
+#ifndef HM_NO_THREADS
+	if (ctx->load_running) {
+		atomic_store(&ctx->load_stop, 1);
+		pthread_join(ctx->load_thread, NULL);
+	}
+#endif
+	ctx->load_running = 0;
+}
+
+static void
+hm_free_patch(struct hm_patch *patch)
+{
+	if (!patch)
+		return;
+	free(patch->data);
+	free(patch->params);
+	free(patch->events);
+	free(patch->tick_events);
+	free(patch->moves);
+	free(patch->loop_cache);
+	free(patch);
+}
+
+/* Frees the patches the render thread has swapped out */
+static void
+hm_collect_patches(struct hm_context *ctx)
+{
+	struct hm_patch *patch = atomic_exchange(&ctx->patch_retired, NULL);
+	struct hm_patch *next;
+	while (patch) {
+		next = patch->next;
+		hm_free_patch(patch);
+		patch = next;
+	}
+}
+
+#ifndef HM_NO_THREADS
+static void *
+hm_prefetch_thread(void *data)
+{
+	struct hm_context *ctx = data;
+	struct hm_sample *sample;
+	struct timespec until;
+	float *frames, peak;
+	uint32_t tail;
+
+	pthread_mutex_lock(&ctx->prefetch_lock);
+	while (!ctx->prefetch_stop) {
+		tail = atomic_load(&ctx->prefetch_tail);
+		if (tail == atomic_load(&ctx->prefetch_head)) {
+			/* The render thread only ever tries the lock */
+			hm_collect_frames(ctx);
+			/*
+			 * A wakeup is missed if the lock was held when it came.
+			 * The deadline is on the wall clock, as
+			 * pthread_cond_timedwait wants.
+			 */
+#if defined(CLOCK_REALTIME)
+			clock_gettime(CLOCK_REALTIME, &until);
+#elif defined(TIME_UTC)
+			timespec_get(&until, TIME_UTC);
+#else
+			until.tv_sec = time(NULL) + 1;
+			until.tv_nsec = 0;
+#endif
+			until.tv_nsec += HM_PREFETCH_POLL_MS * 1000000L;
+			if (until.tv_nsec >= 1000000000L) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&ctx->prefetch_wake,
+				&ctx->prefetch_lock, &until);
+			continue;
+		}
+		pthread_mutex_unlock(&ctx->prefetch_lock);
+
+		sample = ctx->samples
+			+ ctx->prefetch_queue[tail % ctx->num_samples];
+		frames = hm_obtain_frames(sample, sample->source, &peak);
+		if (frames) {
+			sample->prefetched_peak = peak;
+			atomic_store(&sample->prefetched, frames);
+		}
+		atomic_store(&sample->prefetch_queued, 0);
+		atomic_store(&ctx->prefetch_tail, tail + 1);
+
+		pthread_mutex_lock(&ctx->prefetch_lock);
+	}
+	pthread_mutex_unlock(&ctx->prefetch_lock);
+	return NULL;
+}
+#endif
+
+static void
+hm_stop_prefetch(struct hm_context *ctx)
+{
+	int i;
+#ifndef HM_NO_THREADS
+	if (ctx->prefetch_running) {
+		pthread_mutex_lock(&ctx->prefetch_lock);
+		ctx->prefetch_stop = 1;
+		pthread_cond_signal(&ctx->prefetch_wake);
+		pthread_mutex_unlock(&ctx->prefetch_lock);
+		pthread_join(ctx->prefetch_thread, NULL);
+		pthread_cond_destroy(&ctx->prefetch_wake);
+		pthread_mutex_destroy(&ctx->prefetch_lock);
+	}
+#endif
+	ctx->prefetch_running = 0;
+	hm_collect_frames(ctx);
+	/* Requests it never got to can be made again */
+	for (i = 0; i < ctx->num_samples; i++)
+		atomic_store(&ctx->samples[i].prefetch_queued, 0);
+	atomic_store(&ctx->prefetch_head, 0);
+	atomic_store(&ctx->prefetch_tail, 0);
+}
+
+void
+hm_free_context(struct hm_context *ctx)
+{
+	int i;
+	if (!ctx)
+		return;
+	hm_stop_loading(ctx);
+	free(ctx->load_order);
+	free(ctx->data);
+	free(ctx->events);
+	free(ctx->tick_events);
+	hm_stop_prefetch(ctx);
+	free(ctx->prefetch_queue);
+	for (i = 0; i < ctx->num_samples; i++) {
+		hm_drop_frames(ctx->samples + i, ctx->samples[i].frames);
+		free(ctx->samples[i].source);
+		hm_drop_frames(ctx->samples + i,
+			atomic_load(&ctx->samples[i].prefetched));
+	}
+	free(ctx->samples);
+	free(ctx->sync_events);
+	free(ctx->loop_cache);
+	free(ctx->bus_filter);
+	free(ctx->interpolation_filter);
+	hm_free_patch(atomic_load(&ctx->patch_pending));
+	hm_collect_patches(ctx);
+	hm_free_patch(ctx->patch_base);
+	free(ctx);
+}
+
+int
+hm_create_context_ex(struct hm_context **ctxp, const void *data,
+	uint32_t data_length, uint32_t rate,
+	const struct hm_load_options *options)
+{
+	static const struct hm_load_options default_options = { 0 };
+	struct hm_context *ctx;
+	const uint8_t *info = (uint8_t *) data;
+	uint32_t i;
+	uint8_t *mempool;
+
+	if (!options)
+		options = &default_options;
+	if (hm_new_context(ctxp, info, rate, options, &i))
+		return -1;
+	ctx = *ctxp;
+	if (hm_load_samples(ctx, info, data_length, &i))
+		goto fail;
+
+	mempool = malloc(data_length - i ? data_length - i : 1);
+	if (!mempool)
+		goto fail;
+	memcpy(mempool, info + i, (data_length - i));
+	ctx->data = mempool;
+	if (!options->baked || hm_load_baked(ctx, info, data_length, options)) {
+		free(ctx->events);
+		free(ctx->tick_events);
+		if (hm_compile_pattern(ctx)
+			|| hm_decode_samples(ctx, info, options))
+			goto fail;
+	}
+	if (!hm_start_context(ctx))
+		return 0;
+
+fail:
+	hm_free_context(ctx);
+	*ctxp = NULL;
+	return -1;
+}
+
+int
+hm_create_context(struct hm_context **ctxp, const void *data,
+	uint32_t data_length, uint32_t rate)
+{
+	return hm_create_context_ex(ctxp, data, data_length, rate, NULL);
+}
+
+/*
+ * Orders the samples by the tick they first play on, those the pattern
+ * never plays last, and returns how many play in the first HM_OPEN_TICKS.
+ */
+static int
+hm_plan_loading(struct hm_context *ctx)
+{
+	const struct hm_event *event, *end = ctx->events
+		+ ctx->tick_events[ctx->length];
+	uint8_t *queued = calloc(ctx->num_samples ? ctx->num_samples : 1, 1);
+	uint32_t tick = 0;
+	int i, count = 0, opening = 0;
+
+	ctx->load_order = malloc((ctx->num_samples ? ctx->num_samples : 1)
+		* sizeof(uint16_t));
+	if (!queued || !ctx->load_order) {
+		free(queued);
+		return -1;
+	}
+	for (event = ctx->events; event < end; event++) {
+		while (ctx->tick_events[tick + 1] <= event - ctx->events)
+			tick++;
+		if (!(event->flags & HM_EVENT_NOTE)
+			|| event->sample_id == HM_NO_SAMPLE
+			|| queued[event->sample_id])
+			continue;
+		queued[event->sample_id] = 1;
+		ctx->load_order[count++] = event->sample_id;
+		if (tick < HM_OPEN_TICKS)
+			opening = count;
+	}
+	for (i = 0; i < ctx->num_samples; i++)
+		if (!queued[i])
+			ctx->load_order[count++] = i;
+	free(queued);
+	return opening;
+}
+
+/*
+ * Reads the next sample in load_order and decodes it, unless it stays
+ * packed. The render thread takes the frames at its next note, as it does
+ * prefetched ones.
+ */
+static int
+hm_read_sample(struct hm_context *ctx)
+{
+	struct hm_sample *sample = ctx->samples + ctx->load_order[
+		ctx->num_samples - atomic_load(&ctx->load_pending)];
+	uint8_t *data = malloc(sample->data_length ? sample->data_length : 1);
+	float *frames, peak;
+	int error = -1;
+
+	if (data && !ctx->reader.read(ctx->reader.user, sample->data_offset,
+		data, sample->data_length)) {
+		if (sample->shared)
+			sample->share_hash = hm_hash(data, sample->data_length);
+		if (hm_keep_packed(ctx, sample)) {
+			sample->source = data;
+			data = NULL;
+			error = 0;
+		} else if ((frames = hm_obtain_frames(sample, data, &peak))) {
+			sample->peak = peak;
+			sample->prefetched_peak = peak;
+			atomic_store(&sample->prefetched, frames);
+			error = 0;
+		}
+	}
+	free(data);
+	if (error)
+		atomic_store(&ctx->load_failed, 1);
+	atomic_store(&sample->loaded, 1);
+	atomic_fetch_sub(&ctx->load_pending, 1);
+	return error;
+}
+
+#ifndef HM_NO_THREADS
+static void *
+hm_load_thread(void *data)
+{
+	struct hm_context *ctx = data;
+	while (!atomic_load(&ctx->load_stop)
+		&& atomic_load(&ctx->load_pending))
+		hm_read_sample(ctx);
+	return NULL;
+}
+#endif
+
+/*
+ * Loads a module through a reader, returning once the header, the pattern
+ * and the samples played in the first HM_OPEN_TICKS ticks are in. A thread
+ * reads the rest in the order the pattern first plays them, calling the
+ * reader from there, so the reader has to stay usable until hm_loading
+ * gives 0 or the context is freed. Notes of samples that aren't in yet
+ * play nothing. Without threads everything is read before returning.
+ * options->baked is not used. On failure the context is freed and *ctxp
+ * set to NULL.
+ */
+int
+hm_open_context(struct hm_context **ctxp, const struct hm_reader *reader,
+	uint32_t data_length, uint32_t rate,
+	const struct hm_load_options *options)
+{
+	static const struct hm_load_options default_options = { 0 };
+	uint8_t info[HM_MODULE_NAME_LENGTH + 24] = { 0 };
+	uint8_t settings[HM_SAMPLE_HEADER_SIZE];
+	struct hm_context *ctx;
+	struct hm_sample *cur_sample;
+	uint32_t i, index;
+	int j, opening;
+
+	*ctxp = NULL;
+	if (!options)
+		options = &default_options;
+	if (reader->read(reader->user, 0, info, data_length < sizeof(info)
+		? data_length : sizeof(info))
+		|| hm_new_context(ctxp, info, rate, options, &i))
+		return -1;
+	ctx = *ctxp;
+	ctx->reader = *reader;
+
+	for (j = 0; j < ctx->num_samples; j++) {
+		cur_sample = ctx->samples + j;
+		index = 0;
+		if (i > data_length || data_length - i < HM_SAMPLE_HEADER_SIZE
+			|| reader->read(reader->user, i, settings,
+			HM_SAMPLE_HEADER_SIZE))
+			goto fail;
+		hm_load_sample(ctx, cur_sample, settings, &index);
+		cur_sample->data_offset = i + HM_SAMPLE_HEADER_SIZE;
+		if (hm_check_sample(cur_sample)
+			|| data_length - cur_sample->data_offset
+			< cur_sample->data_length)
+			goto fail;
+		i = cur_sample->data_offset + cur_sample->data_length;
+	}
+
+	ctx->data = malloc(data_length - i ? data_length - i : 1);
+	if (!ctx->data || reader->read(reader->user, i, ctx->data,
+		data_length - i) || hm_compile_pattern(ctx))
+		goto fail;
+	hm_plan_samples(ctx, options->flags);
+	opening = hm_plan_loading(ctx);
+	if (opening < 0 || hm_start_context(ctx))
+		goto fail;
+
+	atomic_store(&ctx->load_pending, ctx->num_samples);
+	while (opening--)
+		if (hm_read_sample(ctx))
+			goto fail;
+#ifndef HM_NO_THREADS
+	if (atomic_load(&ctx->load_pending) && !pthread_create(
+		&ctx->load_thread, NULL, hm_load_thread, ctx)) {
+		ctx->load_running = 1;
+		return 0;
+	}
+#endif
+	while (atomic_load(&ctx->load_pending))
+		hm_read_sample(ctx);
+	if (!atomic_load(&ctx->load_failed))
+		return 0;
+fail:
+	hm_free_context(ctx);
+	*ctxp = NULL;
+	return -1;
+}
+
+/*
+ * Samples hm_open_context has still to read, 0 once every one is in, or
+ * -1 if reading one failed. hm_analyze and hm_get_duration look at every
+ * sample, so wait for 0 before calling them.
+ */
+int
+hm_loading(const struct hm_context *ctx)
+{
+	if (atomic_load(&ctx->load_failed))
+		return -1;
+	return atomic_load(&ctx->load_pending);
+}
+
+static int
+hm_write_padding(FILE *file, uint64_t *offset)
+{
+	static const uint8_t zeros[HM_BAKED_ALIGN];
+	const uint64_t count = -*offset & (HM_BAKED_ALIGN - 1);
+	*offset += count;
+	return fwrite(zeros, 1, count, file) == count ? 0 : -1;
+}
+
+/*
+ * Writes a baked file for a module: its compiled pattern and every sample
+ * decoded, converted and laid out as a context loaded at rate with these
+ * options would hold them. Loading the module again with the file in
+ * hm_load_options.baked skips all decoding. The budget in options is
+ * ignored, as everything is decoded for the file.
+ */
+int
+hm_bake(FILE *file, const void *data, uint32_t data_length, uint32_t rate,
+	const struct hm_load_options *options)
+{
+	struct hm_load_options bake_options = { 0 };
+	struct hm_baked_header header;
+	struct hm_baked_sample *table = NULL;
+	struct hm_context *ctx;
+	struct hm_sample *cur_sample;
+	uint64_t offset;
+	int i, error = -1;
+
+	if (options) {
+		bake_options.flags = options->flags & ~HM_SHARE_SAMPLES;
+		bake_options.mix_rate = options->mix_rate;
+	}
+	if (hm_create_context_ex(&ctx, data, data_length, rate,
+		&bake_options))
+		goto done;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HM_BAKED_MAGIC;
+	header.version = HM_BAKED_VERSION;
+	header.source_hash = hm_hash(data, data_length);
+	header.source_length = data_length;
+	header.rate = ctx->rate;
+	header.flags = bake_options.flags & HM_BAKED_FLAGS;
+	header.event_size = sizeof(struct hm_event);
+	header.event_count = ctx->tick_events[ctx->length];
+	header.num_samples = ctx->num_samples;
+	header.length = ctx->length;
+
+	table = calloc(ctx->num_samples ? ctx->num_samples : 1,
+		sizeof(*table));
+	if (!table)
+		goto done;
+	offset = sizeof(header) + ctx->num_samples * sizeof(*table)
+		+ (ctx->length + 1) * sizeof(uint32_t)
+		+ (uint64_t) header.event_count * sizeof(struct hm_event);
+	for (i = 0; i < ctx->num_samples; i++) {
+		cur_sample = ctx->samples + i;
+		if (!cur_sample->frames)
+			goto done;
+		offset += -offset & (HM_BAKED_ALIGN - 1);
+		table[i].offset = offset;
+		table[i].size = hm_sample_size(cur_sample);
+		table[i].frame_count = cur_sample->frame_count;
+		table[i].sample_rate = cur_sample->sample_rate;
+		table[i].loop_start = cur_sample->loop_start;
+		table[i].peak = cur_sample->peak;
+		table[i].channels = cur_sample->channels;
+		table[i].loop = cur_sample->loop;
+		table[i].resampled = cur_sample->resampled;
+		table[i].mip_levels = cur_sample->mip_levels;
+		offset += table[i].size;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1
+		|| fwrite(table, sizeof(*table), ctx->num_samples, file)
+		!= ctx->num_samples
+		|| fwrite(ctx->tick_events, sizeof(uint32_t), ctx->length + 1,
+		file) != ctx->length + 1u
+		|| fwrite(ctx->events, sizeof(struct hm_event),
+		header.event_count, file) != header.event_count)
+		goto done;
+	offset = sizeof(header) + ctx->num_samples * sizeof(*table)
+		+ (ctx->length + 1) * sizeof(uint32_t)
+		+ (uint64_t) header.event_count * sizeof(struct hm_event);
+	for (i = 0; i < ctx->num_samples; i++) {
+		if (hm_write_padding(file, &offset)
+			|| fwrite(ctx->samples[i].frames, 1, table[i].size,
+			file) != table[i].size)
+			goto done;
+		offset += table[i].size;
+	}
+	error = fflush(file) ? -1 : 0;
+done:
+	free(table);
+	hm_free_context(ctx);
+	return error;
+}
+
+/*
+ * Drops least recently used unpinned samples until `needed` more bytes fit
+ * in the budget. Samples without packed data can't be brought back and are
+ * never evicted, so the budget is a soft limit when they fill it.
+ */
+static void
+hm_evict_samples(struct hm_context *ctx, uint64_t needed)
+{
+	int i;
+	struct hm_sample *victim, *cur_sample;
+	while (ctx->sample_memory + needed > ctx->sample_budget) {
+		victim = NULL;
+		for (i = 0; i < ctx->num_samples; i++) {
+			cur_sample = ctx->samples + i;
+			if (!cur_sample->frames || !cur_sample->source
+				|| cur_sample->pins)
+				continue;
+			if (!victim || cur_sample->last_use < victim->last_use)
+				victim = cur_sample;
+		}
+		if (!victim)
+			return;
+		hm_retire_frames(victim, victim->frames, victim->cached);
+		victim->frames = NULL;
+		ctx->sample_memory -= hm_sample_size(victim);
+	}
+}
+
+/*
+ * Drops frames the prefetch thread finished after the render thread had
+ * already decoded the sample itself. Nothing takes them while the sample
+ * is resident, and they aren't counted against the budget.
+ */
+static void
+hm_drop_late_frames(struct hm_sample *sample)
+{
+	if (atomic_load(&sample->prefetched))
+		hm_retire_frames(sample, atomic_exchange(&sample->prefetched,
+			NULL), sample->shared);
+}
+
+static void
+hm_release_sample(struct hm_context *ctx, struct hm_channel *channel)
+{
+	if (channel->pinned) {
+		ctx->samples[channel->sample_id].pins--;
+		channel->pinned = 0;
+	}
+}
+
+static int
+hm_acquire_sample(struct hm_context *ctx, struct hm_channel *channel)
+{
+	struct hm_sample *sample = &ctx->samples[channel->sample_id];
+	float *frames;
+	sample->last_use = ++ctx->sample_clock;
+	if (!sample->frames) {
+		if (!atomic_load(&sample->loaded))
+			return -1;
+		frames = atomic_exchange(&sample->prefetched, NULL);
+		if (!frames && !sample->source)
+			return -1;
+		hm_evict_samples(ctx, hm_sample_size(sample));
+		if (frames) {
+			sample->frames = frames;
+			sample->peak = sample->prefetched_peak;
+			sample->cached = sample->shared;
+		} else {
+			/* Its own copy, as the cache would take its lock */
+			sample->frames = hm_decode_frames(sample,
+				sample->source, &sample->peak);
+			if (!sample->frames)
+				return -1;
+			sample->cached = 0;
+		}
+		ctx->sample_memory += hm_sample_size(sample);
+	} else {
+		hm_drop_late_frames(sample);
+	}
+	sample->pins++;
+	channel->pinned = 1;
+	return 0;
+}
+
+static void
+hm_stop_voice(struct hm_context *ctx, struct hm_channel *channel)
+{
+	channel->sample_frame = -1;
+	hm_release_sample(ctx, channel);
+}
+
+static void
+hm_init_ramp(struct hm_ramp *ramp, uint32_t duration, int32_t start,
+	int32_t end)
+{
+	ramp->enabled = 1;
+	ramp->frame_pos = 0;
+	ramp->frame_duration = duration;
+	ramp->start = start;
+	ramp->end = end;
+}
+
+static void
+hm_process_command(struct hm_context *ctx, struct hm_channel *channel,
+	const struct hm_event *event)
+{
+	switch (event->command) {
+	case 1:
+		if (event->modifier) {
+			hm_init_ramp(channel->ramps + 0,
+				(event->modifier + 1) * ctx->tick_length,
+				(int32_t) (channel->vol * 255.0f),
+				event->target);
+		} else {
+			channel->vol = event->level;
+			channel->ramps[0].enabled = 0;
+		}
+		break;
+	case 2:
+		if (event->modifier) {
+			hm_init_ramp(channel->ramps + 1,
+				(event->modifier + 1) * ctx->tick_length,
+				(int32_t) (channel->pan * 127.0f),
+				event->target);
+		} else {
+			channel->pan = event->level;
+			channel->ramps[1].enabled = 0;
+		}
+		break;
+	case 3:
+		if (event->modifier) {
+			hm_init_ramp(channel->ramps + 2,
+				(event->modifier + 1) * ctx->tick_length,
+				channel->coarse_detune,
+				event->target);
+		} else {
+			channel->coarse_detune = event->target;
+			channel->ramps[2].enabled = 0;
+		}
+		break;
+	case 4:
+		if (event->modifier) {
+			hm_init_ramp(channel->ramps + 3,
+				(event->modifier + 1) * ctx->tick_length,
+				channel->fine_detune,
+				event->target);
+		} else {
+			channel->fine_detune = event->target;
+			channel->ramps[3].enabled = 0;
+		}
+		break;
+	case 5:
+		channel->predelay = event->target
+			* (((float) ctx->rate) / 1000.0f);
+		break;
+	case 6:
+		channel->trills[0].enabled = event->modifier & 1;
+		channel->trills[0].depth = event->target;
+		channel->trills[0].frame_length = (ctx->rate / 100)
+			* event->period;
+		channel->trills[0].frame_pos = channel->trills[0].frame_length;
+		break;
+	case 7:
+		channel->trills[1].enabled = event->modifier != 0;
+		channel->trills[1].depth = event->target;
+		channel->trills[1].frame_length = (ctx->rate / 100)
+			* event->period;
+		channel->trills[1].frame_pos = channel->trills[1].frame_length;
+		break;
+	}
+}
+
+static void
+hm_loop(struct hm_context *ctx)
+{
+	int i, j;
+	ctx->tick_position = ctx->loop_position;
+	for (i = 0; i < ctx->num_channels; i++) {
+		for (j = 0; j < 4; j++)
+			ctx->channels[i].ramps[j].enabled = 0;
+		ctx->channels[i].kernel = NULL;
+	}
+}
+
+static void
+hm_apply_event(struct hm_context *ctx, struct hm_channel *channel,
+	const struct hm_event *event)
+{
+	channel->kernel = NULL;
+	if (event->flags & HM_EVENT_NOTE) {
+		if (event->sample_id != HM_NO_SAMPLE)
+			channel->sample_id = event->sample_id;
+		channel->base_note = event->note;
+
+		channel->key_off = 0;
+
+		channel->coarse_detune = 0;
+		channel->fine_detune = 0;
+		channel->predelay = 0;
+		channel->envelope_timer = 0;
+		channel->fadeout_timer = 0;
+
+		channel->sample_frame = 0;
+		channel->pos_between_samples = 0;
+
+		channel->trills[0].enabled = 0;
+		channel->trills[1].enabled = 0;
+	} else if (event->flags & HM_EVENT_KEY_OFF) {
+		channel->key_off = 1;
+	}
+
+	if (event->flags & HM_EVENT_COMMAND) {
+		channel->command_id = event->command_id;
+		channel->command_param = event->command_param;
+		hm_process_command(ctx, channel, event);
+	}
+}
+
+HM_INLINE float
+hm_clamp(float value)
+{
+	if (value > 1.0f)
+		return 1.0f;
+	if (value < -1.0f)
+		return -1.0f;
+	return value;
+}
+
+static uint64_t
+hm_loop_frames(const struct hm_context *ctx)
+{
+	return (uint64_t) (ctx->length - ctx->loop_position)
+		* ctx->tick_length;
+}
+
+/* Frames into the current pass through the loop */
+static uint64_t
+hm_loop_offset(const struct hm_context *ctx)
+{
+	return (uint64_t) (ctx->tick_position - ctx->loop_position)
+		* ctx->tick_length + ctx->tick_length
+		- ctx->samples_left_in_tick;
+}
+
+/* Everything about a channel that decides what it plays next */
+static int
+hm_channel_equal(const struct hm_channel *a, const struct hm_channel *b)
+{
+	int i;
+	if (a->sample_id != b->sample_id || a->base_note != b->base_note
+		|| a->key_off != b->key_off
+		|| a->command_id != b->command_id
+		|| a->command_param != b->command_param
+		|| a->coarse_detune != b->coarse_detune
+		|| a->fine_detune != b->fine_detune
+		|| a->pan != b->pan || a->vol != b->vol
+		|| a->predelay != b->predelay
+		|| a->sample_frame != b->sample_frame
+		|| a->pos_between_samples != b->pos_between_samples
+		|| a->envelope_timer != b->envelope_timer
+		|| a->fadeout_timer != b->fadeout_timer)
+		return 0;
+	for (i = 0; i < 4; i++) {
+		if (a->ramps[i].enabled != b->ramps[i].enabled)
+			return 0;
+		if (a->ramps[i].enabled && memcmp(a->ramps + i, b->ramps + i,
+			sizeof(struct hm_ramp)))
+			return 0;
+	}
+	for (i = 0; i < 2; i++) {
+		if (a->trills[i].enabled != b->trills[i].enabled
+			|| a->trills[i].depth != b->trills[i].depth
+			|| a->trills[i].up != b->trills[i].up
+			|| a->trills[i].result != b->trills[i].result
+			|| a->trills[i].frame_pos != b->trills[i].frame_pos
+			|| a->trills[i].frame_length
+			!= b->trills[i].frame_length)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Pins every sample the loop plays, so leaving the cache never decodes.
+ * The channels' own samples are included for notes that keep them. Pins
+ * nothing and fails if any of them has been evicted.
+ */
+static int
+hm_pin_loop_samples(struct hm_context *ctx)
+{
+	const struct hm_event *event = ctx->events
+		+ ctx->tick_events[ctx->loop_position];
+	const struct hm_event *end = ctx->events
+		+ ctx->tick_events[ctx->length];
+	struct hm_sample *sample;
+	uint16_t id;
+	int i, missing;
+
+	for (i = 0; i < ctx->num_samples; i++)
+		ctx->samples[i].loop_pinned = 0;
+	for (i = 0; i < ctx->num_channels; i++) {
+		id = ctx->channels[i].sample_id;
+		if (id < ctx->num_samples)
+			ctx->samples[id].loop_pinned = 1;
+	}
+	for (; event < end; event++)
+		if (event->flags & HM_EVENT_NOTE
+			&& event->sample_id < ctx->num_samples)
+			ctx->samples[event->sample_id].loop_pinned = 1;
+
+	for (i = 0; i < ctx->num_samples; i++) {
+		sample = ctx->samples + i;
+		if (sample->loop_pinned && !sample->frames && sample->source)
+			break;
+	}
+	missing = i < ctx->num_samples;
+	for (i = 0; i < ctx->num_samples; i++) {
+		sample = ctx->samples + i;
+		if (missing)
+			sample->loop_pinned = 0;
+		else if (sample->loop_pinned)
+			sample->pins++;
+	}
+	return missing ? -1 : 0;
+}
+
+static void
+hm_unpin_loop_samples(struct hm_context *ctx)
+{
+	int i;
+	for (i = 0; i < ctx->num_samples; i++) {
+		if (ctx->samples[i].loop_pinned) {
+			ctx->samples[i].pins--;
+			ctx->samples[i].loop_pinned = 0;
+		}
+	}
+}
+
+/*
+ * Called at the start of each pass through the loop. If the last pass was
+ * recorded whole and left the channels as it found them, every pass after
+ * it is the same and plays from the recording. Otherwise record this one.
+ */
+static void
+hm_loop_cache_start(struct hm_context *ctx)
+{
+	const size_t frame_size = ctx->flags & HM_CACHE_LOOP_S16
+		? 2 * sizeof(int16_t) : 2 * sizeof(float);
+	int i;
+
+	/* Passes with samples still to come may not sound like the next */
+	if (atomic_load(&ctx->load_pending)) {
+		ctx->loop_cache_state = HM_LOOP_CACHE_IDLE;
+		return;
+	}
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_RECORDING
+		&& ctx->loop_cache_frames == hm_loop_frames(ctx)) {
+		for (i = 0; i < ctx->num_channels; i++)
+			if (!hm_channel_equal(ctx->channels + i,
+				ctx->loop_start + i))
+				break;
+		/* The loop's samples stand in for the channels' pins */
+		if (i == ctx->num_channels && !hm_pin_loop_samples(ctx)) {
+			for (i = 0; i < ctx->num_channels; i++)
+				hm_release_sample(ctx, ctx->channels + i);
+			ctx->loop_cache_state = HM_LOOP_CACHE_PLAYING;
+			return;
+		}
+	}
+
+	if (!ctx->loop_cache)
+		ctx->loop_cache = malloc(hm_loop_frames(ctx) * frame_size);
+	ctx->loop_cache_state = ctx->loop_cache
+		? HM_LOOP_CACHE_RECORDING : HM_LOOP_CACHE_IDLE;
+	ctx->loop_cache_frames = 0;
+	memcpy(ctx->loop_start, ctx->channels, sizeof(ctx->loop_start));
+}
+
+static void
+hm_write_loop_cache(struct hm_context *ctx, const float *frames,
+	uint32_t count)
+{
+	const uint64_t offset = hm_loop_offset(ctx) * 2;
+	int16_t *packed = (int16_t *) ctx->loop_cache + offset;
+	float value;
+	uint32_t i;
+
+	if (ctx->flags & HM_CACHE_LOOP_S16) {
+		for (i = 0; i < count * 2; i++) {
+			value = hm_clamp(frames[i]) * 32767.0f;
+			value += value < 0.0f ? -0.5f : 0.5f;
+			packed[i] = (int16_t) value;
+		}
+	} else {
+		memcpy((float *) ctx->loop_cache + offset, frames,
+			count * 2 * sizeof(float));
+	}
+	ctx->loop_cache_frames += count;
+}
+
+static void
+hm_read_loop_cache(struct hm_context *ctx, float *frames, uint32_t count)
+{
+	const uint64_t offset = hm_loop_offset(ctx) * 2;
+	const int16_t *packed = (const int16_t *) ctx->loop_cache + offset;
+	uint32_t i;
+
+	if (ctx->flags & HM_CACHE_LOOP_S16) {
+		for (i = 0; i < count * 2; i++)
+			frames[i] = packed[i] * (1.0f / 32767.0f);
+	} else {
+		memcpy(frames, (const float *) ctx->loop_cache + offset,
+			count * 2 * sizeof(float));
+	}
+}
+
+/* Queues one sync event, dropping it if the game has fallen behind */
+static void
+hm_push_sync(struct hm_context *ctx, uint8_t type,
+	const struct hm_event *event)
+{
+	const uint32_t head = atomic_load_explicit(&ctx->sync_head,
+		memory_order_relaxed);
+	const uint32_t tail = atomic_load_explicit(&ctx->sync_tail,
+		memory_order_acquire);
+	struct hm_sync_event *sync;
+
+	if (head - tail >= ctx->sync_capacity) {
+		atomic_fetch_add_explicit(&ctx->sync_dropped, 1,
+			memory_order_relaxed);
+		return;
+	}
+	sync = ctx->sync_events + (head & (ctx->sync_capacity - 1));
+	memset(sync, 0, sizeof(struct hm_sync_event));
+	sync->frame = ctx->tick_start * ctx->output_rate / ctx->rate;
+	sync->tick = ctx->tick_position;
+	sync->type = type;
+	if (event) {
+		sync->channel = event->channel;
+		sync->note = event->note;
+		sync->sample_id = event->sample_id;
+		sync->command = event->command;
+		sync->param = event->command_param;
+	}
+	atomic_store_explicit(&ctx->sync_head, head + 1,
+		memory_order_release);
+}
+
+static void
+hm_emit_sync(struct hm_context *ctx)
+{
+	const struct hm_event *event, *end;
+	if (ctx->sync_mask & HM_SYNC_TICK)
+		hm_push_sync(ctx, HM_SYNC_TICK, NULL);
+	if (ctx->sync_mask & HM_SYNC_BEAT
+		&& ctx->tick_position % ctx->subdivision == 0)
+		hm_push_sync(ctx, HM_SYNC_BEAT, NULL);
+	if (!(ctx->sync_mask & (HM_SYNC_NOTE_ON | HM_SYNC_NOTE_OFF
+		| HM_SYNC_COMMAND)))
+		return;
+
+	event = ctx->events + ctx->tick_events[ctx->tick_position];
+	end = ctx->events + ctx->tick_events[ctx->tick_position + 1];
+	for (; event < end; event++) {
+		if (ctx->sync_mask & HM_SYNC_NOTE_ON
+			&& event->flags & HM_EVENT_NOTE)
+			hm_push_sync(ctx, HM_SYNC_NOTE_ON, event);
+		if (ctx->sync_mask & HM_SYNC_NOTE_OFF
+			&& event->flags & HM_EVENT_KEY_OFF)
+			hm_push_sync(ctx, HM_SYNC_NOTE_OFF, event);
+		if (ctx->sync_mask & HM_SYNC_COMMAND
+			&& event->flags & HM_EVENT_COMMAND
+			&& event->command >= 8)
+			hm_push_sync(ctx, HM_SYNC_COMMAND, event);
+	}
+}
+
+/*
+ * Asks the prefetch thread for a sample that isn't resident. Resident ones
+ * count as used, so they aren't evicted before the note that needs them.
+ */
+static void
+hm_prefetch_sample(struct hm_context *ctx, uint16_t sample_id)
+{
+	struct hm_sample *sample = ctx->samples + sample_id;
+	uint32_t head;
+
+	if (sample->frames) {
+		sample->last_use = ++ctx->sample_clock;
+		hm_drop_late_frames(sample);
+		return;
+	}
+	if (!ctx->prefetch_running || !atomic_load(&sample->loaded)
+		|| !sample->source || atomic_load(&sample->prefetched)
+		|| atomic_load(&sample->prefetch_queued))
+		return;
+
+	/* Samples are only queued once, so the queue can't fill */
+	atomic_store(&sample->prefetch_queued, 1);
+	head = atomic_load(&ctx->prefetch_head);
+	ctx->prefetch_queue[head % ctx->num_samples] = sample_id;
+	atomic_store(&ctx->prefetch_head, head + 1);
+#ifndef HM_NO_THREADS
+	/* Never waits: a busy thread looks at the queue again anyway */
+	if (!pthread_mutex_trylock(&ctx->prefetch_lock)) {
+		pthread_cond_signal(&ctx->prefetch_wake);
+		pthread_mutex_unlock(&ctx->prefetch_lock);
+	}
+#endif
+}
+
+/*
+ * Readies the samples for the notes ahead ticks after the current one,
+ * following the loop. Those of the next tick get their first cache lines
+ * fetched too.
+ */
+static void
+hm_prefetch_tick(struct hm_context *ctx, uint32_t ahead)
+{
+	const struct hm_event *event, *end;
+	const float *frames;
+	int64_t tick = ctx->tick_position + ahead;
+	int i;
+
+	if (tick >= ctx->length) {
+		if (ctx->loop_position >= ctx->length)
+			return;
+		tick = ctx->loop_position + (tick - ctx->length)
+			% (ctx->length - ctx->loop_position);
+	}
+	event = ctx->events + ctx->tick_events[tick];
+	end = ctx->events + ctx->tick_events[tick + 1];
+	for (; event < end; event++) {
+		if (!(event->flags & HM_EVENT_NOTE)
+			|| event->sample_id == HM_NO_SAMPLE)
+			continue;
+		hm_prefetch_sample(ctx, event->sample_id);
+		frames = ctx->samples[event->sample_id].frames;
+		if (ahead == 1 && frames)
+			for (i = 0; i < HM_PREFETCH_LINES; i++)
+				HM_PREFETCH(frames + i * 16);
+	}
+}
+
+static void hm_drop_loop_cache(struct hm_context *ctx);
+
+/* Where the tick at position ends up once the patch's moves are made */
+static int64_t
+hm_move_tick(const struct hm_patch *patch, int64_t position)
+{
+	int32_t tick, count;
+	uint32_t i;
+	for (i = 0; i < patch->move_count; i++) {
+		tick = patch->moves[i * 2];
+		count = patch->moves[i * 2 + 1];
+		if (position < tick)
+			continue;
+		if (count > 0 || position >= tick - count)
+			position += count;
+		else
+			position = tick - 1; // Carry on after the removed ticks
+	}
+	return position;
+}
+
+/*
+ * Switches playback over to a committed patch between two ticks. Channels
+ * and decoded samples carry on as they are. The old pattern goes back in
+ * the patch, left for the game thread to free, so nothing is allocated or
+ * freed here.
+ */
+static void
+hm_apply_patch(struct hm_context *ctx, struct hm_patch *patch)
+{
+	uint8_t *data = ctx->data;
+	struct hm_event *events = ctx->events;
+	uint32_t *tick_events = ctx->tick_events;
+	const struct hm_sample_params *params;
+	struct hm_sample *sample;
+	int i;
+
+	/* The cache holds the old pattern, played with the channels idle */
+	hm_drop_loop_cache(ctx);
+	patch->loop_cache = ctx->loop_cache;
+	ctx->loop_cache = NULL;
+
+	ctx->tick_position = hm_move_tick(patch, ctx->tick_position);
+	ctx->data = patch->data;
+	ctx->events = patch->events;
+	ctx->tick_events = patch->tick_events;
+	ctx->length = patch->length;
+	ctx->loop_position = patch->loop_position;
+	patch->data = data;
+	patch->events = events;
+	patch->tick_events = tick_events;
+
+	for (i = 0; i < ctx->num_samples; i++) {
+		sample = ctx->samples + i;
+		params = patch->params + i;
+		if (sample->vol > 0.0f)
+			sample->gain = params->vol / sample->vol;
+		sample->pan = params->pan;
+		sample->relative_note = params->relative_note;
+		sample->key_range_start = params->key_range_start;
+		sample->key_range_end = params->key_range_end;
+		sample->envelope = params->envelope;
+		sample->sustain = params->sustain;
+		memcpy(sample->envelope_ms, params->envelope_ms,
+			sizeof(sample->envelope_ms));
+		hm_scale_envelope(sample, ctx->rate);
+	}
+	for (i = 0; i < ctx->num_channels; i++)
+		ctx->channels[i].kernel = NULL;
+	ctx->unclamped = 0;
+
+	patch->next = atomic_load(&ctx->patch_retired);
+	while (!atomic_compare_exchange_weak(&ctx->patch_retired,
+		&patch->next, patch))
+		;
+}
+
+static void
+hm_load_new_tick(struct hm_context *ctx)
+{
+	const struct hm_event *event, *end;
+	struct hm_channel *channel;
+	struct hm_patch *patch = atomic_exchange(&ctx->patch_pending, NULL);
+	if (patch)
+		hm_apply_patch(ctx, patch);
+	ctx->tick_position++;
+	ctx->tick_start = ctx->tick_end;
+	ctx->tick_end += ctx->tick_length;
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_PLAYING) {
+		if (ctx->tick_position >= ctx->length)
+			ctx->tick_position = ctx->loop_position;
+		if (ctx->sync_mask)
+			hm_emit_sync(ctx);
+		ctx->samples_left_in_tick = ctx->tick_length;
+		return;
+	}
+	if (ctx->tick_position >= ctx->length)
+		hm_loop(ctx);
+	if (ctx->prefetch_ticks) {
+		hm_prefetch_tick(ctx, 1);
+		if (ctx->prefetch_ticks > 1)
+			hm_prefetch_tick(ctx, ctx->prefetch_ticks);
+	}
+	if (ctx->flags & HM_CACHE_LOOP
+		&& ctx->tick_position == ctx->loop_position
+		&& ctx->loop_position < ctx->length)
+		hm_loop_cache_start(ctx);
+	if (ctx->sync_mask)
+		hm_emit_sync(ctx);
+	/* The channels stand still from here; the cache plays this tick too */
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_PLAYING) {
+		ctx->samples_left_in_tick = ctx->tick_length;
+		return;
+	}
+
+	event = ctx->events + ctx->tick_events[ctx->tick_position];
+	end = ctx->events + ctx->tick_events[ctx->tick_position + 1];
+	for (; event < end; event++) {
+		channel = ctx->channels + event->channel;
+		if (event->flags & HM_EVENT_NOTE)
+			hm_release_sample(ctx, channel);
+		hm_apply_event(ctx, channel, event);
+		if (event->flags & HM_EVENT_NOTE
+			&& hm_acquire_sample(ctx, channel))
+			channel->sample_frame = -1;
+	}
+
+	ctx->samples_left_in_tick = ctx->tick_length;
+}
+
+static void
+hm_pan_frame(float *left, float *right, float pan)
+{
+	if (pan < 0.0f) {
+		*right -= *right * (-1.0f * pan);
+	} else if (pan > 0.0f) {
+		*left -= *left * pan;
+	}
+}
+
+static void
+hm_read_frame(const struct hm_sample *sample, uint32_t number, float *left,
+	float *right)
+{
+	if (sample->channels == 2) {
+		*left = sample->frames[number * 2];
+		*right = sample->frames[number * 2 + 1];
+	} else {
+		*left = sample->frames[number];
+		*right = *left;
+	}
+}
+
+static float
+hm_envelope_level(struct hm_channel *channel, const struct hm_sample *sample)
+{
+	float envelope_multiplier = 1.0f;
+
+	if (sample->envelope) {
+		if (channel->envelope_timer < sample->predelay) {
+			channel->envelope_timer++;
+			envelope_multiplier = 0.0f;
+		} else if (channel->envelope_timer < sample->attack) {
+			envelope_multiplier = channel->envelope_timer
+				/ ((float) sample->attack);
+			channel->envelope_timer++;
+		} else if (channel->envelope_timer < sample->hold) {
+			envelope_multiplier = 1.0f;
+			channel->envelope_timer++;
+		} else if (channel->envelope_timer < sample->decay) {
+			envelope_multiplier -=
+				((float) channel->envelope_timer
+				 / (float) sample->decay)
+				* (1.0f - sample->sustain);
+			channel->envelope_timer++;
+		} else {
+			envelope_multiplier = sample->sustain;
+		}
+	}
+	return envelope_multiplier;
+}
+
+/*
+ * Works out how many frames, up to count, the envelope and fadeout stay on
+ * one straight line, along with where each line starts and its slope.
+ */
+static uint32_t
+hm_gain_segment(const struct hm_channel *channel,
+	const struct hm_sample *sample, uint32_t count, float *env,
+	float *env_step, float *fade, float *fade_step)
+{
+	const uint32_t timer = channel->envelope_timer;
+	uint32_t limit = count;
+
+	*env = 1.0f;
+	*env_step = 0.0f;
+	*fade = 1.0f;
+	*fade_step = 0.0f;
+
+	if (sample->envelope) {
+		if (timer < sample->predelay) {
+			*env = 0.0f;
+			limit = sample->predelay - timer;
+		} else if (timer < sample->attack) {
+			*env = timer / ((float) sample->attack);
+			*env_step = 1.0f / (float) sample->attack;
+			limit = sample->attack - timer;
+		} else if (timer < sample->hold) {
+			limit = sample->hold - timer;
+		} else if (timer < sample->decay) {
+			*env -= ((float) timer / (float) sample->decay)
+				* (1.0f - sample->sustain);
+			*env_step = -(1.0f - sample->sustain)
+				/ (float) sample->decay;
+			limit = sample->decay - timer;
+		} else {
+			*env = sample->sustain;
+		}
+		if (limit < count)
+			count = limit;
+	}
+
+	if (channel->key_off) {
+		*fade = 1.0f - (float) (channel->fadeout_timer + 1)
+			/ (float) sample->fadeout;
+		*fade_step = -1.0f / (float) sample->fadeout;
+		limit = sample->fadeout - channel->fadeout_timer;
+		if (limit < count)
+			count = limit;
+	}
+	return count;
+}
+
+static void
+hm_voice_gains(const struct hm_channel *channel,
+	const struct hm_sample *sample, float *left, float *right)
+{
+	*left = channel->vol * sample->gain;
+	*right = channel->vol * sample->gain;
+	hm_pan_frame(left, right, sample->pan);
+	hm_pan_frame(left, right, channel->pan);
+}
+
+/* Sets ramped values for the next frames frames */
+static void
+hm_update_ramps(struct hm_context *ctx, struct hm_channel *channel,
+	uint32_t frames)
+{
+	int i;
+	struct hm_ramp *cur_ramp;
+	int32_t ramp_val;
+	float ramp_pos;
+	for (i = 0; i < 4; i++) {
+		if (channel->ramps[i].enabled) {
+			cur_ramp = channel->ramps + i;
+			ramp_pos = (float) cur_ramp->frame_pos
+				/ (float) cur_ramp->frame_duration;
+			ramp_val = cur_ramp->start + ramp_pos
+				* (cur_ramp->end - cur_ramp->start);
+			switch (i) {
+			case 0:
+				channel->vol = ((float) ramp_val) / 255.0f;
+				break;
+			case 1:
+				channel->pan = (float) ramp_val / 127.0f;
+				break;
+			case 2:
+				channel->coarse_detune = ramp_val;
+				channel->fine_detune = 100
+					* (ramp_pos - (uint32_t) ramp_pos);
+				if (cur_ramp->end < 0)
+					channel->fine_detune *= -1;
+				break;
+			case 3:
+				channel->fine_detune = ramp_val;
+				break;
+			}
+			cur_ramp->frame_pos += frames;
+			if (cur_ramp->frame_pos >= cur_ramp->frame_duration)
+				cur_ramp->enabled = 0;
+		}
+	}
+}
+
+static void
+hm_update_trills(struct hm_context *ctx, struct hm_channel *channel,
+	uint32_t frames)
+{
+	int i;
+	struct hm_trill *cur_trill;
+	int32_t trill_val;
+	uint32_t left;
+	for (i = 0; i < 2; i++) {
+		if (channel->trills[i].enabled) {
+			cur_trill = channel->trills + i;
+			for (left = frames; left; ) {
+				if (left < cur_trill->frame_pos
+					|| !cur_trill->frame_length) {
+					cur_trill->frame_pos -= left;
+					break;
+				}
+				left -= cur_trill->frame_pos;
+				cur_trill->frame_pos = cur_trill->frame_length;
+				cur_trill->up = !cur_trill->up;
+			}
+			switch (i) {
+			case 0:
+				cur_trill->result = cur_trill->up
+					* cur_trill->depth;
+				break;
+			case 1:
+				cur_trill->result = cur_trill->depth
+					- (cur_trill->depth * 2
+					* !cur_trill->up);
+				break;
+			}
+		}
+	}
+}
+
+static double
+hm_step_size(const struct hm_context *ctx, const struct hm_channel *channel,
+	const struct hm_sample *sample)
+{
+	int i, dist;
+	double step_size = 1.0f;
+
+	dist = (sample->relative_note)
+		- (channel->base_note + channel->coarse_detune
+		+ (channel->trills[0].result * channel->trills[0].enabled));
+	if (dist < 0)
+		for (i = 0; i > dist; i--)
+			step_size *= 1 + FREQUENCY_MULTIPLIER;
+	else if (dist > 0)
+		for (i = 0; i < dist; i++)
+			step_size *= 1 - FREQUENCY_MULTIPLIER;
+
+	step_size *= 1 + ((channel->fine_detune
+		+ (channel->trills[1].result * channel->trills[1].enabled))
+		* (FREQUENCY_MULTIPLIER / 100.0f));
+
+	step_size *=  ((double) sample->sample_rate / (double) ctx->rate);
+	return step_size;
+}
+
+static int
+hm_filter_taps(int interpolation)
+{
+	return interpolation == HM_INTERPOLATE_SINC16 ? 16
+		: interpolation == HM_INTERPOLATE_SINC8 ? 8
+		: interpolation == HM_INTERPOLATE_HERMITE ? 4 : 2;
+}
+
+/*
+ * Reads the sample between frame and the next, frac of the way along. The
+ * wider filters read straight from frames unless they reach before the
+ * start or past the guard frames, and take the taps one by one then.
+ */
+HM_INLINE void
+hm_read_interpolated(const struct hm_sample *sample, const float *frames,
+	const float *filter, int64_t frame, double frac, float *left,
+	float *right, const int stereo, const int interpolate)
+{
+	const int taps = hm_filter_taps(interpolate);
+	const int64_t first = frame - taps / 2 + 1;
+	const int channels = stereo ? 2 : 1;
+	float gathered[16 * 2], l, r, l2, r2, t, c0, c1, c2, c3;
+	const float *x, *row;
+	double phase;
+	int k, p;
+
+	if (interpolate <= HM_INTERPOLATE_LINEAR) {
+		if (stereo) {
+			l = frames[frame * 2];
+			r = frames[frame * 2 + 1];
+		} else {
+			l = r = frames[frame];
+		}
+		if (interpolate == HM_INTERPOLATE_LINEAR) {
+			if (stereo) {
+				l2 = frames[frame * 2 + 2];
+				r2 = frames[frame * 2 + 3];
+			} else {
+				l2 = r2 = frames[frame + 1];
+			}
+			l += frac * (l2 - l);
+			r += frac * (r2 - r);
+		}
+		*left = l;
+		*right = r;
+		return;
+	}
+
+	if (first >= 0 && first + taps
+		<= (int64_t) sample->frame_count + HM_GUARD_FRAMES) {
+		x = frames + first * channels;
+	} else {
+		for (k = 0; k < taps; k++) {
+			gathered[k * channels] = hm_tap_frame(sample,
+				first + k, 0);
+			if (stereo)
+				gathered[k * 2 + 1] = hm_tap_frame(sample,
+					first + k, 1);
+		}
+		x = gathered;
+	}
+
+	if (interpolate == HM_INTERPOLATE_HERMITE) {
+		t = frac;
+		for (k = 0; k < channels; k++) {
+			c0 = x[channels + k];
+			c1 = 0.5f * (x[channels * 2 + k] - x[k]);
+			c2 = x[k] - 2.5f * x[channels + k]
+				+ 2.0f * x[channels * 2 + k]
+				- 0.5f * x[channels * 3 + k];
+			c3 = 0.5f * (x[channels * 3 + k] - x[k])
+				+ 1.5f * (x[channels + k]
+				- x[channels * 2 + k]);
+			l = ((c3 * t + c2) * t + c1) * t + c0;
+			if (k)
+				*right = l;
+			else
+				*left = *right = l;
+		}
+		return;
+	}
+
+	/* Blends the two nearest rows of the polyphase table */
+	phase = frac * HM_INTERPOLATE_PHASES;
+	p = (int) phase;
+	t = phase - p;
+	row = filter + p * taps;
+	l = r = l2 = r2 = 0.0f;
+	for (k = 0; k < taps; k++) {
+		l += row[k] * x[k * channels];
+		l2 += row[taps + k] * x[k * channels];
+		if (stereo) {
+			r += row[k] * x[k * 2 + 1];
+			r2 += row[taps + k] * x[k * 2 + 1];
+		}
+	}
+	*left = l + t * (l2 - l);
+	*right = stereo ? r + t * (r2 - r) : *left;
+}
+
+static void
+hm_channel_generate_sample(struct hm_context *ctx, struct hm_channel *channel,
+	float *left, float *right)
+{
+	float l1, r1, l2, r2;
+	float gain_left, gain_right, level;
+	struct hm_sample *sample = &ctx->samples[channel->sample_id];
+	double step_size;
+
+	channel->kernel = NULL;
+	if (channel->sample_frame < 0)
+		return;
+
+	if (channel->predelay > 0) {
+		channel->predelay--;
+		return;
+	}
+	hm_update_ramps(ctx, channel, 1);
+	hm_update_trills(ctx, channel, 1);
+
+	step_size = hm_step_size(ctx, channel, sample);
+	step_size += channel->pos_between_samples;
+
+	channel->sample_frame += (uint32_t) step_size;
+	step_size -= (uint32_t) step_size;
+	channel->pos_between_samples = step_size;
+
+	if (channel->sample_frame >= sample->frame_count) {
+		if (!sample->loop) {
+			hm_stop_voice(ctx, channel);
+			return;
+		}
+		channel->sample_frame = hm_wrap_frame(sample,
+			channel->sample_frame);
+	}
+	if (ctx->interpolation == HM_INTERPOLATE_LINEAR) {
+		hm_read_frame(sample, channel->sample_frame, &l1, &r1);
+		hm_read_frame(sample, channel->sample_frame + 1, &l2, &r2);
+
+		l1 += step_size * (l2 - l1);
+		r1 += step_size * (r2 - r1);
+	} else {
+		hm_read_interpolated(sample, sample->frames,
+			ctx->interpolation_filter, channel->sample_frame,
+			step_size, &l1, &r1, sample->channels == 2,
+			ctx->interpolation);
+	}
+
+	hm_voice_gains(channel, sample, &gain_left, &gain_right);
+	level = hm_envelope_level(channel, sample);
+
+	if (channel->key_off) {
+		channel->fadeout_timer++;
+		if (channel->fadeout_timer > sample->fadeout) {
+			hm_stop_voice(ctx, channel);
+			return;
+		}
+		level *= 1.0f - (float) channel->fadeout_timer
+			/ (float) sample->fadeout;
+	}
+
+	l1 *= gain_left * level;
+	r1 *= gain_right * level;
+
+	if (l1 > 1.0f)
+		l1 = 1.0f;
+	if (r1 > 1.0f)
+		r1 = 1.0f;
+	if (l1 < -1.0f)
+		l1 = -1.0f;
+	if (r1 < -1.0f)
+		r1 = -1.0f;
+
+	*left += l1;
+	*right += r1;
+}
+
+void
+hm_mixdown(struct hm_context *ctx, float *left, float *right)
+{
+	int i;
+	float frame[2];
+	if (ctx->samples_left_in_tick <= 0)
+		hm_load_new_tick(ctx);
+	*left = *right = 0.0f;
+
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_PLAYING) {
+		hm_read_loop_cache(ctx, frame, 1);
+		*left = frame[0];
+		*right = frame[1];
+	} else {
+		for (i = 0; i < ctx->num_channels; i++)
+			hm_channel_generate_sample(ctx, ctx->channels + i,
+				left, right);
+	}
+	ctx->samples_left_in_tick--;
+
+	if (*left > 1.0f)
+		*left = 1.0f;
+	if (*right > 1.0f)
+		*right = 1.0f;
+	if (*left < -1.0f)
+		*left = -1.0f;
+	if (*right < -1.0f)
+		*right = -1.0f;
+}
+
+static int
+hm_channel_modulated(const struct hm_channel *channel)
+{
+	return channel->ramps[0].enabled | channel->ramps[1].enabled
+		| channel->ramps[2].enabled | channel->ramps[3].enabled
+		| channel->trills[0].enabled | channel->trills[1].enabled;
+}
+
+/*
+ * Frames that can be stepped through before the position reaches the end
+ * of the sample. Rounding may put the last of them on the first guard
+ * frame, which holds what the wrapped read would have returned anyway.
+ */
+static uint32_t
+hm_frames_before_end(int64_t frame, double frac, double step,
+	int64_t frame_count)
+{
+	const double run = ((double) (frame_count - frame) - frac) / step;
+	if (!(step > 0.0) || run >= (double) UINT32_MAX)
+		return UINT32_MAX;
+	return run > 0.0 ? (uint32_t) run : 0;
+}
+
+/*
+ * Picks the level of a sample's copies that brings step, in the sample's
+ * own frames, under HM_MIPMAP_STEP, and moves frame and frac over to it
+ * from level shift. Returns the level, with view set up to read it.
+ */
+static int
+hm_mip_level(const struct hm_sample *sample, double step, int shift,
+	int64_t *frame, double *frac, struct hm_sample *view)
+{
+	int level = 0;
+	uint32_t advance;
+	while (level < sample->mip_levels && step > HM_MIPMAP_STEP) {
+		step *= 0.5;
+		level++;
+	}
+	if (level != shift) {
+		*frac *= 1 << shift;
+		advance = (uint32_t) *frac;
+		*frame = (*frame << shift) + advance;
+		*frac = ((*frame & ((1 << level) - 1)) + *frac - advance)
+			/ (1 << level);
+		*frame >>= level;
+	}
+	hm_mip_view(sample, sample->frames, level, view);
+	return level;
+}
+
+HM_INLINE void
+hm_mix_frame(const struct hm_sample *sample, const float *frames,
+	const float *filter, int64_t frame, double frac, float gain_left,
+	float gain_right, float *out, const int stereo, const int interpolate)
+{
+	float l1, r1;
+	hm_read_interpolated(sample, frames, filter, frame, frac, &l1, &r1,
+		stereo, interpolate);
+	l1 *= gain_left;
+	r1 *= gain_right;
+
+	l1 = l1 > 1.0f ? 1.0f : l1 < -1.0f ? -1.0f : l1;
+	r1 = r1 > 1.0f ? 1.0f : r1 < -1.0f ? -1.0f : r1;
+
+	out[0] += l1;
+	out[1] += r1;
+}
+
+/*
+ * Body shared by every mixing kernel. The flags are compile time constants
+ * in each instance, so the unused paths drop out. Static kernels work out
+ * pitch and gain once, then run straight up to the end of the sample or
+ * loop with no checks in the loop, wrapping only between runs. Modulated
+ * ones follow ramps and trills frame by frame, and hand back to the caller
+ * once those are done. Without mix, the voice only moves forward.
+ */
+HM_INLINE uint32_t
+hm_render_voice(struct hm_context *ctx, struct hm_channel *channel,
+	float *buffer, uint32_t count, const int stereo, const int envelope,
+	const int loop, const int modulated, const int mix,
+	const int interpolate)
+{
+	struct hm_sample *sample = &ctx->samples[channel->sample_id];
+	const struct hm_sample *source = sample; // Level being read
+	const float *frames = sample->frames;
+	const float *filter = ctx->interpolation_filter;
+	int64_t frame_count = sample->frame_count;
+	int64_t frame = channel->sample_frame;
+	double frac = channel->pos_between_samples, step = 0.0, scale = 1.0;
+	struct hm_sample view;
+	int shift = 0;
+	float gain_left = 0.0f, gain_right = 0.0f;
+	float env = 1.0f, env_step = 0.0f, fade = 1.0f, fade_step = 0.0f;
+	float level = 1.0f;
+	uint32_t i = 0, n = count, run, advance, hold = 0, span;
+	int stopped = 0;
+
+	if (modulated) {
+		if (!envelope && sample->envelope)
+			env = sample->sustain;
+	} else {
+		if (channel->key_off
+			&& channel->fadeout_timer >= sample->fadeout) {
+			hm_stop_voice(ctx, channel);
+			return 0;
+		}
+		step = hm_step_size(ctx, channel, sample);
+		if (mix && sample->mip_levels) {
+			shift = hm_mip_level(sample, step, shift, &frame, &frac,
+				&view);
+			source = &view;
+			frames = view.frames;
+			frame_count = view.frame_count;
+			scale = 1 << shift;
+		}
+		step /= scale;
+		hm_voice_gains(channel, sample, &gain_left, &gain_right);
+		n = hm_gain_segment(channel, sample, count, &env, &env_step,
+			&fade, &fade_step);
+		if (!envelope) {
+			gain_left *= env * fade;
+			gain_right *= env * fade;
+		}
+	}
+
+	while (i < n) {
+		if (!modulated) {
+			run = hm_frames_before_end(frame, frac, step,
+				frame_count);
+			if (run > n - i)
+				run = n - i;
+			if (!mix) {
+				frac += (double) run * step;
+				advance = (uint32_t) frac;
+				frame += advance;
+				frac -= advance;
+				i += run;
+				run = 0;
+			}
+			/* Samples already at the output rate play as a copy */
+			if (step == 1.0 && frac == 0.0) {
+				for (; run; run--, i++) {
+					frame++;
+					if (envelope)
+						level = (env + env_step
+							* (float) i) * (fade
+							+ fade_step * (float) i);
+					hm_mix_frame(source, frames, filter,
+						frame, 0.0,
+						gain_left * level,
+						gain_right * level,
+						buffer + i * 2, stereo, 0);
+				}
+			}
+			for (; run; run--, i++) {
+				frac += step;
+				advance = (uint32_t) frac;
+				frame += advance;
+				frac -= advance;
+				if (envelope)
+					level = (env + env_step * (float) i)
+						* (fade + fade_step * (float) i);
+				hm_mix_frame(source, frames, filter, frame,
+					frac, gain_left * level,
+					gain_right * level, buffer + i * 2,
+					stereo, interpolate);
+			}
+			if (i == n)
+				break;
+		} else if (!hold) {
+			if (i && !hm_channel_modulated(channel))
+				break;
+			/* Held for control_frames at reduced quality */
+			span = n - i < ctx->control_frames
+				? n - i : ctx->control_frames;
+			hm_update_ramps(ctx, channel, span);
+			hm_update_trills(ctx, channel, span);
+			step = hm_step_size(ctx, channel, sample);
+			if (mix && sample->mip_levels) {
+				shift = hm_mip_level(sample, step, shift,
+					&frame, &frac, &view);
+				source = &view;
+				frames = view.frames;
+				frame_count = view.frame_count;
+				scale = 1 << shift;
+			}
+			step /= scale;
+			hm_voice_gains(channel, sample, &gain_left,
+				&gain_right);
+			hold = span;
+		}
+		if (hold)
+			hold--;
+
+		frac += step;
+		advance = (uint32_t) frac;
+		frame += advance;
+		frac -= advance;
+		if (frame >= frame_count) {
+			if (!loop) {
+				stopped = 1;
+				break;
+			}
+			frame = hm_wrap_frame(source, frame);
+		}
+
+		if (modulated && envelope) {
+			env = hm_envelope_level(channel, sample);
+			if (channel->key_off) {
+				channel->fadeout_timer++;
+				if (channel->fadeout_timer > sample->fadeout) {
+					stopped = 1;
+					break;
+				}
+				fade = 1.0f - (float) channel->fadeout_timer
+					/ (float) sample->fadeout;
+			}
+			level = env * fade;
+		} else if (modulated) {
+			level = env;
+		} else if (envelope) {
+			level = (env + env_step * (float) i)
+				* (fade + fade_step * (float) i);
+		}
+		if (mix)
+			hm_mix_frame(source, frames, filter, frame, frac,
+				gain_left * level, gain_right * level,
+				buffer + i * 2, stereo, interpolate);
+		i++;
+	}
+
+	if (shift) {
+		frac *= scale;
+		advance = (uint32_t) frac;
+		frame = (frame << shift) + advance;
+		frac -= advance;
+	}
+	channel->sample_frame = frame;
+	channel->pos_between_samples = frac;
+	if (!modulated) {
+		if (sample->envelope
+			&& channel->envelope_timer < sample->decay)
+			channel->envelope_timer += i;
+		if (channel->key_off)
+			channel->fadeout_timer += i;
+	}
+	if (stopped)
+		hm_stop_voice(ctx, channel);
+	return i;
+}
+
+#define HM_KERNEL(interpolate, stereo, envelope, loop, modulated) \
+static uint32_t \
+hm_kernel_##interpolate##stereo##envelope##loop##modulated( \
+	struct hm_context *ctx, struct hm_channel *channel, float *buffer, \
+	uint32_t count) \
+{ \
+	return hm_render_voice(ctx, channel, buffer, count, stereo, \
+		envelope, loop, modulated, 1, interpolate); \
+}
+
+#define HM_KERNELS(interpolate) \
+HM_KERNEL(interpolate, 0, 0, 0, 0) \
+HM_KERNEL(interpolate, 0, 0, 0, 1) \
+HM_KERNEL(interpolate, 0, 0, 1, 0) \
+HM_KERNEL(interpolate, 0, 0, 1, 1) \
+HM_KERNEL(interpolate, 0, 1, 0, 0) \
+HM_KERNEL(interpolate, 0, 1, 0, 1) \
+HM_KERNEL(interpolate, 0, 1, 1, 0) \
+HM_KERNEL(interpolate, 0, 1, 1, 1) \
+HM_KERNEL(interpolate, 1, 0, 0, 0) \
+HM_KERNEL(interpolate, 1, 0, 0, 1) \
+HM_KERNEL(interpolate, 1, 0, 1, 0) \
+HM_KERNEL(interpolate, 1, 0, 1, 1) \
+HM_KERNEL(interpolate, 1, 1, 0, 0) \
+HM_KERNEL(interpolate, 1, 1, 0, 1) \
+HM_KERNEL(interpolate, 1, 1, 1, 0) \
+HM_KERNEL(interpolate, 1, 1, 1, 1)
+
+HM_KERNELS(0)
+HM_KERNELS(1)
+HM_KERNELS(2)
+HM_KERNELS(3)
+HM_KERNELS(4)
+
+#define HM_KERNEL_ROW(i) \
+	hm_kernel_##i##0000, hm_kernel_##i##0001, hm_kernel_##i##0010, \
+	hm_kernel_##i##0011, hm_kernel_##i##0100, hm_kernel_##i##0101, \
+	hm_kernel_##i##0110, hm_kernel_##i##0111, hm_kernel_##i##1000, \
+	hm_kernel_##i##1001, hm_kernel_##i##1010, hm_kernel_##i##1011, \
+	hm_kernel_##i##1100, hm_kernel_##i##1101, hm_kernel_##i##1110, \
+	hm_kernel_##i##1111
+
+/*
+ * Indexed by interpolation << 4 | stereo << 3 | envelope << 2 | loop << 1
+ * | modulated
+ */
+static const hm_kernel hm_kernels[HM_INTERPOLATE_MODES * 16] = {
+	HM_KERNEL_ROW(0), HM_KERNEL_ROW(1), HM_KERNEL_ROW(2),
+	HM_KERNEL_ROW(3), HM_KERNEL_ROW(4)
+};
+
+static hm_kernel
+hm_select_kernel(const struct hm_context *ctx, const struct hm_channel *channel)
+{
+	const struct hm_sample *sample = &ctx->samples[channel->sample_id];
+	const int stereo = sample->channels == 2;
+	const int envelope = channel->key_off || (sample->envelope
+		&& channel->envelope_timer < sample->decay);
+	const int loop = sample->loop != 0;
+	const int interpolate = ctx->quality < HM_QUALITY_NEAREST
+		? ctx->interpolation : HM_INTERPOLATE_NEAREST;
+	return hm_kernels[interpolate << 4 | stereo << 3 | envelope << 2
+		| loop << 1 | hm_channel_modulated(channel)];
+}
+
+static void
+hm_channel_render(struct hm_context *ctx, struct hm_channel *channel,
+	float *buffer, uint32_t count)
+{
+	uint32_t done;
+	while (count && channel->sample_frame >= 0) {
+		if (channel->predelay > 0) {
+			done = channel->predelay < count
+				? channel->predelay : count;
+			channel->predelay -= done;
+		} else {
+			if (!channel->kernel)
+				channel->kernel = hm_select_kernel(ctx, channel);
+			done = channel->kernel(ctx, channel, buffer, count);
+			if (done < count)
+				channel->kernel = NULL;
+		}
+		buffer += done * 2;
+		count -= done;
+	}
+}
+
+/* Moves a voice through count frames without mixing it */
+static uint32_t
+hm_channel_skip(struct hm_context *ctx, struct hm_channel *channel,
+	uint32_t count)
+{
+	const struct hm_sample *sample;
+	uint32_t done, total = 0;
+	int stereo, envelope, loop;
+	while (total < count && channel->sample_frame >= 0) {
+		if (channel->predelay > 0) {
+			done = channel->predelay < count - total
+				? channel->predelay : count - total;
+			channel->predelay -= done;
+		} else {
+			sample = &ctx->samples[channel->sample_id];
+			stereo = sample->channels == 2;
+			envelope = channel->key_off || (sample->envelope
+				&& channel->envelope_timer < sample->decay);
+			loop = sample->loop != 0;
+			done = hm_render_voice(ctx, channel, NULL,
+				count - total, stereo, envelope, loop,
+				hm_channel_modulated(channel), 0, 0);
+		}
+		total += done;
+	}
+	return total;
+}
+
+static float
+hm_voice_loudness(const struct hm_context *ctx,
+	const struct hm_channel *channel)
+{
+	const struct hm_sample *sample = &ctx->samples[channel->sample_id];
+	float loudness = channel->vol * sample->vol * sample->gain;
+	if (sample->envelope && channel->envelope_timer >= sample->decay)
+		loudness *= sample->sustain;
+	if (channel->key_off && sample->fadeout)
+		loudness *= 1.0f - (float) channel->fadeout_timer
+			/ (float) sample->fadeout;
+	return loudness;
+}
+
+/*
+ * Picks the voices over voice_limit to skip this block, lowest priority
+ * first and the quietest among those. Returns them as a channel mask.
+ */
+static uint32_t
+hm_shed_voices(struct hm_context *ctx)
+{
+	uint32_t active = 0, shed = 0;
+	int i, count = 0, victim;
+	float loudness, quietest = 0.0f;
+
+	for (i = 0; i < ctx->num_channels; i++) {
+		if (ctx->channels[i].sample_frame >= 0) {
+			active |= 1u << i;
+			count++;
+		}
+	}
+	ctx->shed_voices = 0;
+	for (; count > ctx->voice_limit; count--) {
+		victim = -1;
+		for (i = 0; i < ctx->num_channels; i++) {
+			if (!(active >> i & 1) || shed >> i & 1)
+				continue;
+			loudness = hm_voice_loudness(ctx, ctx->channels + i);
+			if (victim < 0 || ctx->priority[i] < ctx->priority[victim]
+				|| (ctx->priority[i] == ctx->priority[victim]
+				&& loudness < quietest)) {
+				victim = i;
+				quietest = loudness;
+			}
+		}
+		shed |= 1u << victim;
+		ctx->shed_voices++;
+	}
+	return shed;
+}
+
+/* Mixes every voice into buffer, or plays it from the loop cache */
+static void
+hm_mix_channels(struct hm_context *ctx, float *buffer, uint32_t count)
+{
+	uint32_t i;
+	uint32_t shed = 0;
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_PLAYING) {
+		hm_read_loop_cache(ctx, buffer, count);
+		return;
+	}
+	if (ctx->quality >= HM_QUALITY_SHED)
+		shed = hm_shed_voices(ctx);
+	memset(buffer, 0, count * 2 * sizeof(float));
+	for (i = 0; i < ctx->num_channels; i++) {
+		if (shed >> i & 1)
+			hm_channel_skip(ctx, ctx->channels + i, count);
+		else
+			hm_channel_render(ctx, ctx->channels + i, buffer,
+				count);
+	}
+	/* Only full quality passes are worth replaying */
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_RECORDING
+		&& ctx->quality == HM_QUALITY_FULL)
+		hm_write_loop_cache(ctx, buffer, count);
+}
+
+/*
+ * Goes back to rendering live. The channels have stood still since the
+ * pass began, so they're brought up to where playback is now. Their
+ * samples were kept pinned, so taking the pins back decodes nothing.
+ */
+static void
+hm_drop_loop_cache(struct hm_context *ctx)
+{
+	const struct hm_event *event, *end;
+	struct hm_channel *channel;
+	uint32_t frames;
+	int64_t tick;
+	int i;
+
+	if (ctx->loop_cache_state == HM_LOOP_CACHE_PLAYING) {
+		for (tick = ctx->loop_position; tick <= ctx->tick_position;
+			tick++) {
+			event = ctx->events + ctx->tick_events[tick];
+			end = ctx->events + ctx->tick_events[tick + 1];
+			for (; event < end; event++)
+				hm_apply_event(ctx,
+					ctx->channels + event->channel, event);
+			frames = tick < ctx->tick_position ? ctx->tick_length
+				: ctx->tick_length - ctx->samples_left_in_tick;
+			for (i = 0; i < ctx->num_channels; i++)
+				hm_channel_skip(ctx, ctx->channels + i,
+					frames);
+		}
+		for (i = 0; i < ctx->num_channels; i++) {
+			channel = ctx->channels + i;
+			if (channel->sample_frame >= 0
+				&& hm_acquire_sample(ctx, channel))
+				channel->sample_frame = -1;
+		}
+		hm_unpin_loop_samples(ctx);
+	}
+	ctx->loop_cache_state = HM_LOOP_CACHE_IDLE;
+}
+
+static void
+hm_clamp_frames(float *buffer, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i < count * 2; i++)
+		buffer[i] = hm_clamp(buffer[i]);
+}
+
+/*
+ * Looks ticks ticks ahead of playback for notes and has a thread decode
+ * the samples they need that aren't resident, so their first note doesn't
+ * decode on the render thread. Samples it decodes count against the budget
+ * once their note plays. The samples for the next tick's notes have their
+ * first cache lines fetched. Without threads only that is done. 0 stops
+ * looking ahead. Call it between renders.
+ */
+int
+hm_set_prefetch(struct hm_context *ctx, uint32_t ticks)
+{
+	uint32_t i;
+
+	hm_stop_prefetch(ctx);
+	ctx->prefetch_ticks = ticks;
+	if (!ticks)
+		return 0;
+#ifndef HM_NO_THREADS
+	if (!ctx->prefetch_queue)
+		ctx->prefetch_queue = malloc((ctx->num_samples
+			? ctx->num_samples : 1) * sizeof(uint16_t));
+	if (!ctx->prefetch_queue
+		|| pthread_mutex_init(&ctx->prefetch_lock, NULL)) {
+		ctx->prefetch_ticks = 0;
+		return -1;
+	}
+	pthread_cond_init(&ctx->prefetch_wake, NULL);
+	ctx->prefetch_stop = 0;
+	if (pthread_create(&ctx->prefetch_thread, NULL, hm_prefetch_thread,
+		ctx)) {
+		pthread_cond_destroy(&ctx->prefetch_wake);
+		pthread_mutex_destroy(&ctx->prefetch_lock);
+		ctx->prefetch_ticks = 0;
+		return -1;
+	}
+	ctx->prefetch_running = 1;
+#endif
+	for (i = 1; i <= ticks; i++)
+		hm_prefetch_tick(ctx, i);
+	return 0;
+}
+
+/*
+ * Chooses how voices read between sample frames when at full quality. The
+ * sinc modes convolve with a Blackman windowed sinc taken from a table of
+ * HM_INTERPOLATE_PHASES rows, built here, so they're meant for offline
+ * renders. Call it between renders.
+ */
+int
+hm_set_interpolation(struct hm_context *ctx, int mode)
+{
+	const int taps = hm_filter_taps(mode);
+	const int half = taps / 2;
+	double x, weight, sum;
+	float *filter, *row;
+	int phase, k, i;
+
+	if (mode < 0 || mode >= HM_INTERPOLATE_MODES)
+		return -1;
+	if (mode == HM_INTERPOLATE_SINC8 || mode == HM_INTERPOLATE_SINC16) {
+		filter = malloc((HM_INTERPOLATE_PHASES + 1) * taps
+			* sizeof(float));
+		if (!filter)
+			return -1;
+		for (phase = 0; phase <= HM_INTERPOLATE_PHASES; phase++) {
+			row = filter + phase * taps;
+			sum = 0.0;
+			for (k = 0; k < taps; k++) {
+				x = k - half + 1 - (double) phase
+					/ HM_INTERPOLATE_PHASES;
+				weight = hm_blackman_sinc(x, half);
+				row[k] = weight;
+				sum += weight;
+			}
+			for (k = 0; k < taps; k++)
+				row[k] /= sum;
+		}
+		free(ctx->interpolation_filter);
+		ctx->interpolation_filter = filter;
+	}
+	if (mode != ctx->interpolation)
+		ctx->unclamped = 0;
+	ctx->interpolation = mode;
+	for (i = 0; i < ctx->num_channels; i++)
+		ctx->channels[i].kernel = NULL;
+	return 0;
+}
+
+void
+hm_set_quality(struct hm_context *ctx, int quality)
+{
+	int i;
+	if (quality < HM_QUALITY_FULL)
+		quality = HM_QUALITY_FULL;
+	if (quality > HM_QUALITY_MAX)
+		quality = HM_QUALITY_MAX;
+	ctx->quality = quality;
+	ctx->control_frames = quality >= HM_QUALITY_CONTROL_RATE
+		? HM_CONTROL_FRAMES : 1;
+	ctx->voice_limit = ctx->num_channels;
+	for (i = HM_QUALITY_SHED; i <= quality; i++)
+		ctx->voice_limit -= ctx->voice_limit / (i == HM_QUALITY_SHED
+			? 4 : 2);
+	if (!ctx->voice_limit)
+		ctx->voice_limit = 1;
+	ctx->shed_voices = 0;
+	for (i = 0; i < ctx->num_channels; i++)
+		ctx->channels[i].kernel = NULL;
+}
+
+/*
+ * Lets quality follow render time. budget is the share of real time a
+ * render call may take, 0.5 for half of the audio it produces; 0 turns
+ * the governor off and leaves quality where it is.
+ */
+void
+hm_set_governor(struct hm_context *ctx, float budget)
+{
+	ctx->budget = budget;
+	ctx->load = 0.0f;
+	ctx->calm_calls = 0;
+	ctx->settle_calls = HM_GOVERNOR_SETTLE;
+}
+
+/* Higher priorities are shed last, -1 for a channel the module lacks */
+int
+hm_set_priority(struct hm_context *ctx, int channel, uint8_t priority)
+{
+	if (channel < 0 || channel >= ctx->num_channels)
+		return -1;
+	ctx->priority[channel] = priority;
+	return 0;
+}
+
+void
+hm_get_stats(const struct hm_context *ctx, struct hm_stats *stats)
+{
+	int i;
+	stats->quality = ctx->quality;
+	stats->active_voices = 0;
+	for (i = 0; i < ctx->num_channels; i++)
+		if (ctx->channels[i].sample_frame >= 0)
+			stats->active_voices++;
+	stats->shed_voices = ctx->shed_voices;
+	stats->load = ctx->load;
+	stats->budget = ctx->budget;
+	stats->sync_dropped = atomic_load_explicit(&ctx->sync_dropped,
+		memory_order_relaxed);
+}
+
+/*
+ * Starts queueing the HM_SYNC_ events in mask for hm_poll_sync, in a
+ * queue of at least capacity events allocated now. Call it while nothing
+ * is rendering; a mask of 0 stops the events.
+ */
+int
+hm_set_sync(struct hm_context *ctx, uint32_t mask, uint32_t capacity)
+{
+	uint32_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	if (mask && size != ctx->sync_capacity) {
+		free(ctx->sync_events);
+		ctx->sync_events = malloc(size
+			* sizeof(struct hm_sync_event));
+		ctx->sync_capacity = ctx->sync_events ? size : 0;
+		if (!ctx->sync_events) {
+			ctx->sync_mask = 0;
+			return -1;
+		}
+	}
+	atomic_store(&ctx->sync_head, 0);
+	atomic_store(&ctx->sync_tail, 0);
+	ctx->sync_mask = mask;
+	return 0;
+}
+
+/*
+ * Takes up to max queued events, oldest first. Safe to call from one
+ * thread while another renders.
+ */
+uint32_t
+hm_poll_sync(struct hm_context *ctx, struct hm_sync_event *events,
+	uint32_t max)
+{
+	const uint32_t tail = atomic_load_explicit(&ctx->sync_tail,
+		memory_order_relaxed);
+	const uint32_t head = atomic_load_explicit(&ctx->sync_head,
+		memory_order_acquire);
+	uint32_t i, count = head - tail;
+
+	if (count > max)
+		count = max;
+	for (i = 0; i < count; i++)
+		events[i] = ctx->sync_events[(tail + i)
+			& (ctx->sync_capacity - 1)];
+	atomic_store_explicit(&ctx->sync_tail, tail + count,
+		memory_order_release);
+	return count;
+}
+
+static size_t
+hm_patch_size(const struct hm_patch *patch)
+{
+	return (size_t) patch->length * patch->num_channels * 4;
+}
+
+static struct hm_patch *
+hm_alloc_patch(const struct hm_context *ctx, uint16_t length)
+{
+	struct hm_patch *patch = calloc(1, sizeof(struct hm_patch));
+	if (!patch)
+		return NULL;
+	patch->length = length;
+	patch->num_channels = ctx->num_channels;
+	patch->num_samples = ctx->num_samples;
+	patch->data = malloc(hm_patch_size(patch) ? hm_patch_size(patch) : 1);
+	patch->params = malloc((ctx->num_samples ? ctx->num_samples : 1)
+		* sizeof(struct hm_sample_params));
+	if (!patch->data || !patch->params) {
+		hm_free_patch(patch);
+		return NULL;
+	}
+	return patch;
+}
+
+static void
+hm_copy_patch(struct hm_patch *to, const struct hm_patch *from)
+{
+	memcpy(to->data, from->data, hm_patch_size(from));
+	memcpy(to->params, from->params,
+		from->num_samples * sizeof(struct hm_sample_params));
+	to->loop_position = from->loop_position;
+}
+
+/*
+ * Starts an edit of the module as of the last commit. Only the game thread
+ * should make and commit patches, and nothing reaches playback until
+ * hm_patch_commit. Returns NULL when out of memory.
+ */
+struct hm_patch *
+hm_patch_begin(struct hm_context *ctx)
+{
+	const struct hm_patch *base = ctx->patch_base;
+	struct hm_sample_params *params;
+	const struct hm_sample *sample;
+	struct hm_patch *patch;
+	int i;
+
+	hm_collect_patches(ctx);
+	hm_collect_frames(ctx);
+	patch = hm_alloc_patch(ctx, base ? base->length : ctx->length);
+	if (!patch)
+		return NULL;
+	if (base) {
+		hm_copy_patch(patch, base);
+		return patch;
+	}
+
+	/* Nothing committed yet, so the render thread never changed these */
+	memcpy(patch->data, ctx->data, hm_patch_size(patch));
+	patch->loop_position = ctx->loop_position;
+	for (i = 0; i < ctx->num_samples; i++) {
+		sample = ctx->samples + i;
+		params = patch->params + i;
+		params->vol = sample->vol * sample->gain;
+		params->pan = sample->pan;
+		params->relative_note = sample->relative_note;
+		params->key_range_start = sample->key_range_start;
+		params->key_range_end = sample->key_range_end;
+		params->envelope = sample->envelope;
+		params->sustain = sample->sustain;
+		memcpy(params->envelope_ms, sample->envelope_ms,
+			sizeof(params->envelope_ms));
+	}
+	return patch;
+}
+
+/*
+ * Sets a cell as stored in the module: the top bit of the first byte marks
+ * a note, the rest of it is the note plus one or 0 for a key off, then come
+ * the instrument, the command and its parameter.
+ */
+int
+hm_patch_cell(struct hm_patch *patch, uint32_t tick, uint8_t channel,
+	const uint8_t cell[4])
+{
+	if (tick >= patch->length || channel >= patch->num_channels)
+		return -1;
+	memcpy(patch->data + ((size_t) tick * patch->num_channels + channel)
+		* 4, cell, 4);
+	return 0;
+}
+
+int
+hm_patch_sample(struct hm_patch *patch, uint16_t sample_id,
+	const struct hm_sample_params *params)
+{
+	if (sample_id >= patch->num_samples)
+		return -1;
+	patch->params[sample_id] = *params;
+	return 0;
+}
+
+static int
+hm_patch_move(struct hm_patch *patch, int32_t tick, int32_t count)
+{
+	int32_t *moves = realloc(patch->moves,
+		(patch->move_count + 1) * 2 * sizeof(int32_t));
+	if (!moves)
+		return -1;
+	moves[patch->move_count * 2] = tick;
+	moves[patch->move_count * 2 + 1] = count;
+	patch->moves = moves;
+	patch->move_count++;
+	return 0;
+}
+
+/*
+ * Inserts count empty ticks before tick, or at the end when tick is the
+ * length. Ticks inserted at the loop point come before the loop.
+ */
+int
+hm_patch_insert_ticks(struct hm_patch *patch, uint32_t tick, uint32_t count)
+{
+	const size_t row = (size_t) patch->num_channels * 4;
+	uint8_t *data;
+
+	if (tick > patch->length || count > 65535u - patch->length)
+		return -1;
+	if (!count)
+		return 0;
+	data = realloc(patch->data, (patch->length + count) * row);
+	if (!data)
+		return -1;
+	patch->data = data;
+	if (hm_patch_move(patch, tick, count))
+		return -1;
+	memmove(data + (tick + count) * row, data + tick * row,
+		(patch->length - tick) * row);
+	memset(data + tick * row, 0, count * row);
+	if (patch->loop_position >= tick)
+		patch->loop_position += count;
+	patch->length += count;
+	return 0;
+}
+
+/*
+ * Removes count ticks from tick on, keeping at least one. Playback inside
+ * them carries on after them, and a loop point inside them moves there.
+ */
+int
+hm_patch_remove_ticks(struct hm_patch *patch, uint32_t tick, uint32_t count)
+{
+	const size_t row = (size_t) patch->num_channels * 4;
+
+	if (tick >= patch->length || count >= patch->length
+		|| count > patch->length - tick)
+		return -1;
+	if (!count)
+		return 0;
+	if (hm_patch_move(patch, tick, -(int32_t) count))
+		return -1;
+	memmove(patch->data + tick * row, patch->data + (tick + count) * row,
+		(patch->length - tick - count) * row);
+	if (patch->loop_position >= tick + count)
+		patch->loop_position -= count;
+	else if (patch->loop_position > tick)
+		patch->loop_position = tick;
+	patch->length -= count;
+	return 0;
+}
+
+void
+hm_patch_cancel(struct hm_patch *patch)
+{
+	hm_free_patch(patch);
+}
+
+/* Puts the moves of a patch that never played ahead of patch's own */
+static int
+hm_patch_merge_moves(struct hm_patch *patch, const struct hm_patch *skipped)
+{
+	const uint32_t count = skipped->move_count + patch->move_count;
+	int32_t *moves;
+	if (!skipped->move_count)
+		return 0;
+	moves = malloc(count * 2 * sizeof(int32_t));
+	if (!moves)
+		return -1;
+	memcpy(moves, skipped->moves,
+		skipped->move_count * 2 * sizeof(int32_t));
+	if (patch->move_count)
+		memcpy(moves + skipped->move_count * 2, patch->moves,
+			patch->move_count * 2 * sizeof(int32_t));
+	free(patch->moves);
+	patch->moves = moves;
+	patch->move_count = count;
+	return 0;
+}
+
+/*
+ * Compiles patch and hands it to the render thread, which switches to it
+ * at the next tick boundary without a lock. A patch committed before the
+ * last one was taken replaces it. ctx owns patch from here on, even when
+ * this fails.
+ */
+int
+hm_patch_commit(struct hm_context *ctx, struct hm_patch *patch)
+{
+	struct hm_patch *base, *waiting = NULL;
+
+	base = hm_alloc_patch(ctx, patch->length);
+	if (!base || hm_compile_cells(ctx, patch->data, patch->length,
+		patch->params, &patch->events, &patch->tick_events)) {
+		hm_free_patch(base);
+		hm_free_patch(patch);
+		return -1;
+	}
+	hm_copy_patch(base, patch);
+
+	if (!atomic_compare_exchange_strong(&ctx->patch_pending, &waiting,
+		patch)) {
+		/* Only the render thread takes it, so it's ours if still there */
+		waiting = atomic_exchange(&ctx->patch_pending, NULL);
+		if (waiting && hm_patch_merge_moves(patch, waiting)) {
+			atomic_store(&ctx->patch_pending, waiting);
+			hm_free_patch(base);
+			hm_free_patch(patch);
+			return -1;
+		}
+		hm_free_patch(waiting);
+		atomic_store(&ctx->patch_pending, patch);
+	}
+
+	hm_free_patch(ctx->patch_base);
+	ctx->patch_base = base;
+	hm_collect_patches(ctx);
+	hm_collect_frames(ctx);
+	return 0;
+}
+
+/*
+ * Seconds from a steady clock, for timing render calls. Define HM_CLOCK()
+ * as an expression giving seconds to supply another. Without POSIX or C11
+ * clocks this falls back on clock(), which counts processor time.
+ */
+static double
+hm_clock(void)
+{
+#if defined(HM_CLOCK)
+	return HM_CLOCK();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#elif defined(TIME_UTC)
+	struct timespec now;
+	timespec_get(&now, TIME_UTC);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#else
+	return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* Folds one render call's time into the load and moves quality to suit */
+static void
+hm_govern(struct hm_context *ctx, double seconds, uint64_t frame_count)
+{
+	const float load = seconds * ctx->output_rate / frame_count;
+	ctx->load += (load - ctx->load) * 0.25f;
+	ctx->settle_calls++;
+	if (ctx->load > ctx->budget) {
+		ctx->calm_calls = 0;
+		if (ctx->quality < HM_QUALITY_MAX
+			&& ctx->settle_calls >= HM_GOVERNOR_SETTLE) {
+			hm_set_quality(ctx, ctx->quality + 1);
+			ctx->settle_calls = 0;
+		}
+	} else if (ctx->load < ctx->budget * HM_GOVERNOR_HEADROOM) {
+		if (++ctx->calm_calls >= HM_GOVERNOR_HOLD
+			&& ctx->quality > HM_QUALITY_FULL) {
+			hm_set_quality(ctx, ctx->quality - 1);
+			ctx->calm_calls = 0;
+		}
+	} else {
+		ctx->calm_calls = 0;
+	}
+}
+
+/* Mixes frames at ctx->rate, before the master bus */
+static void
+hm_render_mix(struct hm_context *ctx, float *buffer, uint64_t sample_count)
+{
+	uint32_t count;
+	while (sample_count) {
+		if (ctx->samples_left_in_tick <= 0)
+			hm_load_new_tick(ctx);
+		count = ctx->samples_left_in_tick;
+		if (count > sample_count)
+			count = sample_count;
+
+		hm_mix_channels(ctx, buffer, count);
+		if (!ctx->unclamped)
+			hm_clamp_frames(buffer, count);
+
+		ctx->samples_left_in_tick -= count;
+		buffer += count * 2;
+		sample_count -= count;
+	}
+}
+
+/* Resamples the mix to output_rate, mixing more as the filter needs it */
+static void
+hm_upsample(struct hm_context *ctx, float *out, uint64_t count)
+{
+	const uint32_t capacity = HM_BLOCK_FRAMES + HM_UPSAMPLE_TAPS * 2;
+	const int taps = HM_UPSAMPLE_TAPS * 2;
+	const float *row, *source;
+	uint32_t base, drop;
+	uint64_t i;
+	float left, right;
+	int k;
+
+	for (i = 0; i < count; i++) {
+		base = (uint32_t) ctx->bus_position;
+		if (base + HM_UPSAMPLE_TAPS >= ctx->bus_frames) {
+			drop = base - (HM_UPSAMPLE_TAPS - 1);
+			memmove(ctx->bus, ctx->bus + drop * 2,
+				(ctx->bus_frames - drop) * 2 * sizeof(float));
+			ctx->bus_frames -= drop;
+			ctx->bus_position -= drop;
+			base -= drop;
+			hm_render_mix(ctx, ctx->bus + ctx->bus_frames * 2,
+				capacity - ctx->bus_frames);
+			ctx->bus_frames = capacity;
+		}
+
+		row = ctx->bus_filter + (uint32_t) ((ctx->bus_position - base)
+			* HM_UPSAMPLE_PHASES + 0.5) * taps;
+		source = ctx->bus + (base - (HM_UPSAMPLE_TAPS - 1)) * 2;
+		left = right = 0.0f;
+		for (k = 0; k < taps; k++) {
+			left += source[k * 2] * row[k];
+			right += source[k * 2 + 1] * row[k];
+		}
+		out[i * 2] = hm_clamp(left);
+		out[i * 2 + 1] = hm_clamp(right);
+		ctx->bus_position += ctx->bus_step;
+	}
+}
+
+void
+hm_generate_samples(struct hm_context *ctx, float *buffer, uint64_t sample_count)
+{
+	const double start = ctx->budget > 0.0f ? hm_clock() : 0.0;
+	if (ctx->bus_filter)
+		hm_upsample(ctx, buffer, sample_count);
+	else
+		hm_render_mix(ctx, buffer, sample_count);
+	if (ctx->budget > 0.0f && sample_count)
+		hm_govern(ctx, hm_clock() - start, sample_count);
+}
+
+/*
+ * Renders every channel once, mixing each into the stem picked by
+ * groups[channel], or its own stem when groups is NULL. Stems are
+ * interleaved stereo like hm_generate_samples and are not clamped, so they
+ * add up to the master mix, which goes to mix unless it is NULL. Channels
+ * grouped past stem_count only reach the mix.
+ */
+void
+hm_generate_stems(struct hm_context *ctx, float **stems,
+	const uint8_t *groups, uint32_t stem_count, float *mix,
+	uint64_t sample_count)
+{
+	uint64_t offset = 0;
+	uint32_t i, j, count, group;
+	float *target;
+	hm_drop_loop_cache(ctx);
+	while (sample_count) {
+		if (ctx->samples_left_in_tick <= 0)
+			hm_load_new_tick(ctx);
+		count = ctx->samples_left_in_tick;
+		if (count > sample_count)
+			count = sample_count;
+		if (count > HM_BLOCK_FRAMES)
+			count = HM_BLOCK_FRAMES;
+
+		for (i = 0; i < stem_count; i++)
+			memset(stems[i] + offset * 2, 0,
+				count * 2 * sizeof(float));
+		if (mix)
+			memset(mix + offset * 2, 0, count * 2 * sizeof(float));
+		else
+			memset(ctx->scratch, 0, count * 2 * sizeof(float));
+
+		for (i = 0; i < ctx->num_channels; i++) {
+			group = groups ? groups[i] : i;
+			if (group < stem_count)
+				target = stems[group] + offset * 2;
+			else
+				target = mix ? mix + offset * 2 : ctx->scratch;
+			hm_channel_render(ctx, ctx->channels + i, target,
+				count);
+		}
+
+		if (mix) {
+			for (i = 0; i < stem_count; i++)
+				for (j = 0; j < count * 2; j++)
+					mix[offset * 2 + j]
+						+= stems[i][offset * 2 + j];
+			hm_clamp_frames(mix + offset * 2, count);
+		}
+
+		ctx->samples_left_in_tick -= count;
+		offset += count;
+		sample_count -= count;
+	}
+}
+
+/*
+ * A copy of ctx at the start of the song that shares its samples, for
+ * playing the pattern through without mixing. Free it with free().
+ */
+static struct hm_context *
+hm_simulation(const struct hm_context *ctx)
+{
+	struct hm_context *sim = malloc(sizeof(struct hm_context));
+	int i;
+	if (!sim)
+		return NULL;
+	memcpy(sim, ctx, sizeof(struct hm_context));
+	memset(sim->channels, 0, sizeof(sim->channels));
+	atomic_init(&sim->patch_pending, NULL);
+	for (i = 0; i < sim->num_channels; i++) {
+		sim->channels[i].vol = 1.0f;
+		sim->channels[i].sample_frame = -1;
+	}
+	return sim;
+}
+
+static void
+hm_simulate_events(struct hm_context *sim, int tick)
+{
+	const struct hm_event *event = sim->events + sim->tick_events[tick];
+	const struct hm_event *end = sim->events + sim->tick_events[tick + 1];
+	for (; event < end; event++)
+		hm_apply_event(sim, sim->channels + event->channel, event);
+}
+
+static void
+hm_simulate_tick(struct hm_context *sim, int tick)
+{
+	int i;
+	hm_simulate_events(sim, tick);
+	for (i = 0; i < sim->num_channels; i++)
+		hm_channel_skip(sim, sim->channels + i, sim->tick_length);
+}
+
+/*
+ * Frames until a voice left playing at the end of the pattern goes quiet,
+ * HM_DURATION_INFINITE if it holds a loop forever.
+ */
+static uint64_t
+hm_voice_tail(struct hm_context *ctx, struct hm_channel *channel)
+{
+	const struct hm_sample *sample = &ctx->samples[channel->sample_id];
+	uint64_t tail = 0, limit = HM_DURATION_INFINITE;
+	uint32_t done;
+
+	if (channel->sample_frame < 0)
+		return 0;
+	if (channel->vol == 0.0f && !channel->ramps[0].enabled)
+		return 0;
+	if (sample->envelope && sample->sustain == 0.0f && !channel->key_off) {
+		limit = channel->predelay;
+		if (channel->envelope_timer < sample->decay)
+			limit += sample->decay - channel->envelope_timer;
+	}
+	if (sample->loop && !channel->key_off)
+		return limit;
+
+	while (tail < limit && channel->sample_frame >= 0) {
+		done = hm_channel_skip(ctx, channel, HM_BLOCK_FRAMES);
+		tail += done;
+		if (!done)
+			break;
+	}
+	return tail < limit ? tail : limit;
+}
+
+int
+hm_get_duration(struct hm_context *ctx, struct hm_duration *duration)
+{
+	struct hm_context *sim;
+	uint64_t tail;
+	int i, tick;
+
+	duration->intro_frames = (uint64_t) ctx->loop_position
+		* ctx->tick_length;
+	duration->loop_frames = ctx->loop_position < ctx->length
+		? (uint64_t) (ctx->length - ctx->loop_position)
+		* ctx->tick_length : 0;
+	duration->tail_frames = 0;
+
+	/* Play the pattern once through on a copy, without its samples */
+	sim = hm_simulation(ctx);
+	if (!sim)
+		return -1;
+	for (tick = 0; tick < sim->length; tick++)
+		hm_simulate_tick(sim, tick);
+
+	for (i = 0; i < sim->num_channels; i++) {
+		tail = hm_voice_tail(sim, sim->channels + i);
+		if (tail > duration->tail_frames)
+			duration->tail_frames = tail;
+	}
+	free(sim);
+
+	/* Counted in mixed frames so far */
+	if (ctx->rate != ctx->output_rate) {
+		duration->intro_frames = duration->intro_frames
+			* ctx->output_rate / ctx->rate;
+		duration->loop_frames = duration->loop_frames
+			* ctx->output_rate / ctx->rate;
+		if (duration->tail_frames != HM_DURATION_INFINITE)
+			duration->tail_frames = duration->tail_frames
+				* ctx->output_rate / ctx->rate;
+	}
+	return 0;
+}
+
+/* Largest magnitude a sample reaches, decoding it for a moment if need be */
+static float
+hm_sample_peak(struct hm_sample *sample)
+{
+	if (sample->peak < 0.0f && !sample->frames && sample->source
+		&& !hm_decode_sample(sample, sample->source)) {
+		hm_drop_frames(sample, sample->frames);
+		sample->frames = NULL;
+	}
+	return sample->peak > 0.0f ? sample->peak : 0.0f;
+}
+
+/*
+ * Plays the pattern through twice without mixing, the second time from
+ * the loop point so voices held across the loop are counted, and records
+ * the busiest tick. The context plays on as before.
+ */
+int
+hm_analyze(struct hm_context *ctx, struct hm_analysis *analysis)
+{
+	const struct hm_event *event;
+	const struct hm_channel *channel;
+	const struct hm_sample *sample;
+	struct hm_context *sim;
+	float cost, headroom, gain;
+	int i, tick, pass, voices, modulated;
 
-				channel->sample_frame = 0;
-				channel->pos_between_samples = 0;
+	memset(analysis, 0, sizeof(struct hm_analysis));
+	for (event = ctx->events; event < ctx->events
+		+ ctx->tick_events[ctx->length]; event++) {
+		if (!(event->flags & HM_EVENT_COMMAND))
+			continue;
+		if (event->command >= 1 && event->command <= 4
+			&& event->modifier)
+			analysis->ramp_commands++;
+		if (event->command == 6 || event->command == 7)
+			analysis->trill_commands++;
+	}
+	if (ctx->length) {
+		analysis->ramp_density = (float) analysis->ramp_commands
+			/ ctx->length;
+		analysis->trill_density = (float) analysis->trill_commands
+			/ ctx->length;
+	}
+	for (i = 0; i < ctx->num_samples; i++)
+		hm_sample_peak(ctx->samples + i);
 
-				channel->trills[0].enabled = 0;
-				channel->trills[1].enabled = 0;
-			} else {
-				channel->key_off = 1;
+	sim = hm_simulation(ctx);
+	if (!sim)
+		return -1;
+	for (pass = 0; pass < 2; pass++) {
+		tick = pass ? ctx->loop_position : 0;
+		for (; tick < ctx->length; tick++) {
+			hm_simulate_events(sim, tick);
+			voices = modulated = 0;
+			cost = headroom = 0.0f;
+			for (i = 0; i < sim->num_channels; i++) {
+				channel = sim->channels + i;
+				if (channel->sample_frame < 0)
+					continue;
+				sample = sim->samples + channel->sample_id;
+				voices++;
+				gain = channel->vol * sample->gain;
+				if (channel->ramps[0].enabled)
+					gain = sample->gain;
+				headroom += (sample->peak > 0.0f
+					? sample->peak : 0.0f) * gain;
+				cost += (sample->channels == 2
+					? HM_COST_STEREO : 1.0f)
+					* (hm_channel_modulated(channel)
+					? HM_COST_MODULATED : 1.0f);
+				modulated += hm_channel_modulated(channel);
 			}
+			if (voices > analysis->max_voices)
+				analysis->max_voices = voices;
+			if (modulated > analysis->max_modulated)
+				analysis->max_modulated = modulated;
+			if (cost > analysis->peak_cost)
+				analysis->peak_cost = cost;
+			if (headroom > analysis->headroom)
+				analysis->headroom = headroom;
+			for (i = 0; i < sim->num_channels; i++)
+				hm_channel_skip(sim, sim->channels + i,
+					sim->tick_length);
 		}
-		data_index += 2;
+	}
+	free(sim);
+	return 0;
+}
+
+/*
+ * Stops clamping the mix if analysis, from hm_analyze on this context,
+ * shows the voices' peaks can't add up past full scale. Changing the
+ * interpolation or applying a patch clamps again, as does passing NULL.
+ * Call it between renders. -1 if the mix has to stay clamped.
+ */
+int
+hm_set_clamp(struct hm_context *ctx, const struct hm_analysis *analysis)
+{
+	/*
+	 * Peaks are of the decoded frames. Only nearest and linear reads stay
+	 * within them: the cubic and sinc modes overshoot, and so can the
+	 * filtered mipmap copies.
+	 */
+	ctx->unclamped = analysis && analysis->headroom <= 1.0f
+		&& ctx->interpolation <= HM_INTERPOLATE_LINEAR
+		&& !(ctx->flags & HM_MIPMAP);
+	return ctx->unclamped || !analysis ? 0 : -1;
+}
+
+static uint32_t
+hm_rescale(uint32_t frames, uint32_t from, uint32_t to)
+{
+	return ((uint64_t) frames * to + from / 2) / from;
+}
+
+/*
+ * Switches a playing context to a new mixing rate. Everything counted in
+ * mixed frames is scaled to match, so playback carries on from the same
+ * point in the song. Samples keep their frames and are stepped through at
+ * the new ratio. The output needn't match a context created at the new
+ * rate sample for sample: ramps and trills already played were stepped
+ * once per frame at the old rate, which moves voices along slightly
+ * differently.
+ */
+static int
+hm_change_rate(struct hm_context *ctx, uint32_t rate)
+{
+	const uint32_t old_rate = ctx->rate;
+	const uint32_t old_tick = ctx->tick_length;
+	struct hm_channel *channel;
+	struct hm_trill *trill;
+	struct hm_ramp *ramp;
+	int i, j;
+
+	if (!rate)
+		return -1;
+	if (rate == old_rate)
+		return 0;
+
+	hm_drop_loop_cache(ctx);
+	free(ctx->loop_cache);
+	ctx->loop_cache = NULL;
+	ctx->rate = rate;
+	ctx->tick_length = hm_tick_length(ctx, rate);
+	ctx->samples_left_in_tick = hm_rescale(ctx->samples_left_in_tick,
+		old_tick, ctx->tick_length);
+	ctx->tick_start = ctx->tick_start * rate / old_rate;
+	ctx->tick_end = ctx->tick_start + ctx->tick_length;
+	for (i = 0; i < ctx->num_samples; i++)
+		hm_scale_envelope(ctx->samples + i, rate);
 
-		if (ctx->data[data_index]) {
-			channel->command_id = ctx->data[data_index];
-			channel->command_param = ctx->data[data_index + 1];
-			hm_process_command(ctx, channel);
-			channel->predelay *= ((float) ctx->rate) / 1000.0f;
+	for (i = 0; i < ctx->num_channels; i++) {
+		channel = ctx->channels + i;
+		channel->kernel = NULL;
+		channel->predelay = hm_rescale(channel->predelay, old_rate,
+			rate);
+		channel->envelope_timer = hm_rescale(channel->envelope_timer,
+			old_rate, rate);
+		channel->fadeout_timer = hm_rescale(channel->fadeout_timer,
+			old_rate, rate);
+		/* Ramps last whole ticks */
+		for (j = 0; j < 4; j++) {
+			ramp = channel->ramps + j;
+			ramp->frame_pos = hm_rescale(ramp->frame_pos, old_tick,
+				ctx->tick_length);
+			ramp->frame_duration = ramp->frame_duration / old_tick
+				* ctx->tick_length;
+			if (ramp->enabled
+				&& ramp->frame_pos >= ramp->frame_duration)
+				ramp->enabled = 0;
+		}
+		/* Trill periods are whole hundredths of a second */
+		for (j = 0; j < 2; j++) {
+			trill = channel->trills + j;
+			if (old_rate / 100) {
+				trill->frame_length = trill->frame_length
+					/ (old_rate / 100) * (rate / 100);
+			}
+			if (!trill->frame_pos)
+				continue;
+			trill->frame_pos = hm_rescale(trill->frame_pos,
+				old_rate, rate);
+			if (trill->frame_pos > trill->frame_length)
+				trill->frame_pos = trill->frame_length;
+			if (!trill->frame_pos)
+				trill->frame_pos = 1;
 		}
-		data_index += 2;
 	}
+	return 0;
+}
 
-	ctx->samples_left_in_tick = ctx->tick_length;
+/*
+ * Moves a playing context to a new output rate. A context mixing at its
+ * output rate keeps doing so; one with its own mixing rate keeps that and
+ * only retunes the master bus.
+ */
+int
+hm_set_rate(struct hm_context *ctx, uint32_t rate)
+{
+	if (!rate)
+		return -1;
+	if (ctx->rate == ctx->output_rate && hm_change_rate(ctx, rate))
+		return -1;
+	ctx->output_rate = rate;
+	return hm_setup_bus(ctx, 0);
 }
 
-static void
-hm_pan_frame(float *left, float *right, float pan)
+/*
+ * Mixes voices at rate and resamples the result to the output rate on the
+ * master bus, so each voice costs in proportion to rate. hm_mixdown and
+ * hm_generate_stems skip the bus and produce frames at the mixing rate.
+ */
+int
+hm_set_mix_rate(struct hm_context *ctx, uint32_t rate)
 {
-	if (pan < 0.0f) {
-		*right -= *right * (-1.0f * pan);
-	} else if (pan > 0.0f) {
-		*left -= *left * pan;
-	}
+	if (rate == ctx->rate)
+		return 0;
+	if (hm_change_rate(ctx, rate))
+		return -1;
+	return hm_setup_bus(ctx, 1);
 }
 
+/* Clamps a block rendered into scratch and writes it where output says */
 static void
-hm_read_sample(struct hm_sample *sample, uint32_t number, float *left, float *right)
+hm_write_output(const float *frames, uint32_t count,
+	const struct hm_output *output, uint64_t offset)
 {
-	float panned_sample;
-	float envelope_multiplier = 1.0f;
+	const uint32_t stride = output->stride;
+	const float gain = output->gain;
+	const int accumulate = output->flags & HM_OUTPUT_ACCUMULATE;
+	float *left = output->left + offset * stride;
+	float *right;
+	float l, r;
+	uint32_t i;
 
-	if (sample->channels == 2) {
-		*left = sample->frames[number * 2];
-		*right = sample->frames[number * 2 + 1];
-	} else {
-		*left = sample->frames[number];
-		*right = *left;
+	if (output->flags & HM_OUTPUT_MONO) {
+		for (i = 0; i < count; i++) {
+			l = hm_clamp(frames[i * 2]);
+			r = hm_clamp(frames[i * 2 + 1]);
+			l = (l + r) * 0.5f * gain;
+			if (accumulate)
+				left[i * stride] += l;
+			else
+				left[i * stride] = l;
+		}
+		return;
 	}
 
-	hm_pan_frame(left, right, sample->pan);
-
-	if (sample->envelope) {
-		if (sample->envelope_timer < sample->predelay) {
-			sample->envelope_timer++;
-			envelope_multiplier = 0.0f;
-		} else if (sample->envelope_timer < sample->attack) {
-			envelope_multiplier = sample->envelope_timer
-				/ ((float) sample->attack);
-			sample->envelope_timer++;
-		} else if (sample->envelope_timer < sample->hold) {
-			envelope_multiplier = 1.0f;
-			sample->envelope_timer++;
-		} else if (sample->envelope_timer < sample->decay) {
-			envelope_multiplier -=
-				((float) sample->envelope_timer
-				 / (float) sample->decay)
-				* (1.0f - sample->sustain);
-			sample->envelope_timer++;
+	right = output->right + offset * stride;
+	for (i = 0; i < count; i++) {
+		l = hm_clamp(frames[i * 2]) * gain;
+		r = hm_clamp(frames[i * 2 + 1]) * gain;
+		if (accumulate) {
+			left[i * stride] += l;
+			right[i * stride] += r;
 		} else {
-			envelope_multiplier = sample->sustain;
+			left[i * stride] = l;
+			right[i * stride] = r;
 		}
-
-		*left *= envelope_multiplier;
-		*right *= envelope_multiplier;
 	}
 }
 
-static void
-hm_update_ramps(struct hm_context *ctx, struct hm_channel *channel)
+/*
+ * Like hm_generate_samples, but writes into the host's own layout, as
+ * described by output, in the same pass that clamps the mix.
+ */
+void
+hm_generate_output(struct hm_context *ctx, const struct hm_output *output,
+	uint64_t sample_count)
 {
-	int i;
-	struct hm_ramp *cur_ramp;
-	int32_t ramp_val;
-	float ramp_pos;
-	for (i = 0; i < 4; i++) {
-		if (channel->ramps[i].enabled) {
-			cur_ramp = channel->ramps + i;
-			ramp_pos = (float) cur_ramp->frame_pos
-				/ (float) cur_ramp->frame_duration;
-			ramp_val = cur_ramp->start + ramp_pos
-				* (cur_ramp->end - cur_ramp->start);
-			switch (i) {
-			case 0:
-				channel->vol = ((float) ramp_val) / 255.0f;
-				break;
-			case 1:
-				channel->pan = (float) ramp_val / 127.0f;
-				break;
-			case 2:
-				channel->coarse_detune = ramp_val;
-				channel->fine_detune = 100
-					* (ramp_pos - (uint32_t) ramp_pos);
-				if (cur_ramp->end < 0)
-					channel->fine_detune *= -1;
-				break;
-			case 3:
-				channel->fine_detune = ramp_val;
-				break;
-			}
-			cur_ramp->frame_pos++;
-			if (cur_ramp->frame_pos >= cur_ramp->frame_duration)
-				cur_ramp->enabled = 0;
+	const double start = ctx->budget > 0.0f ? hm_clock() : 0.0;
+	uint64_t offset = 0;
+	uint32_t count;
+	while (sample_count) {
+		count = sample_count < HM_BLOCK_FRAMES
+			? sample_count : HM_BLOCK_FRAMES;
+		if (ctx->bus_filter) {
+			hm_upsample(ctx, ctx->scratch, count);
+		} else {
+			if (ctx->samples_left_in_tick <= 0)
+				hm_load_new_tick(ctx);
+			if (count > ctx->samples_left_in_tick)
+				count = ctx->samples_left_in_tick;
+			hm_mix_channels(ctx, ctx->scratch, count);
+			ctx->samples_left_in_tick -= count;
 		}
+		hm_write_output(ctx->scratch, count, output, offset);
+
+		offset += count;
+		sample_count -= count;
 	}
+	if (ctx->budget > 0.0f && offset)
+		hm_govern(ctx, hm_clock() - start, offset);
 }
 
-static void
-hm_update_trills(struct hm_context *ctx, struct hm_channel *channel)
+void
+hm_mixer_init(struct hm_mixer *mixer)
 {
+	memset(mixer, 0, sizeof(struct hm_mixer));
+}
+
+/* Hands ctx to the mixer. Returns its slot, or -1 if every slot is taken */
+int
+hm_mixer_add(struct hm_mixer *mixer, struct hm_context *ctx, float gain)
+{
+	struct hm_mixer_source *source;
 	int i;
-	struct hm_trill *cur_trill;
-	int32_t trill_val;
-	for (i = 0; i < 4; i++) {
-		if (channel->trills[i].enabled) {
-			cur_trill = channel->trills + i;
-			cur_trill->frame_pos--;
-			if (!cur_trill->frame_pos) {
-				cur_trill->frame_pos = cur_trill->frame_length;
-				cur_trill->up = !cur_trill->up;
-			}
-			switch (i) {
-			case 0:
-				cur_trill->result = cur_trill->up
-					* cur_trill->depth;
-				break;
-			case 1:
-				cur_trill->result = cur_trill->depth
-					- (cur_trill->depth * 2
-					* !cur_trill->up);
-				break;
-			}
-		}
+	for (i = 0; i < HM_MIXER_SOURCES; i++) {
+		source = mixer->sources + i;
+		if (source->ctx)
+			continue;
+		memset(source, 0, sizeof(struct hm_mixer_source));
+		source->ctx = ctx;
+		source->gain = gain;
+		return i;
 	}
+	return -1;
 }
 
-static void
-hm_channel_generate_sample(struct hm_context *ctx, struct hm_channel *channel,
-	float *left, float *right)
+/* Frees a slot's source. -1 for a slot the mixer lacks */
+int
+hm_mixer_remove(struct hm_mixer *mixer, int slot)
 {
-	int i, dist;
-	float l1 = 0, r1 = 0;
-	float l2 = 0, r2 = 0;
-	struct hm_sample *sample = &ctx->samples[channel->sample_id];
-	double step_size = 1.0f;
-	float panned_sample;
+	if (slot < 0 || slot >= HM_MIXER_SOURCES)
+		return -1;
+	hm_free_context(mixer->sources[slot].ctx);
+	mixer->sources[slot].ctx = NULL;
+	return 0;
+}
 
-	if (channel->sample_frame < 0)
-		return;
+void
+hm_mixer_free(struct hm_mixer *mixer)
+{
+	int i;
+	for (i = 0; i < HM_MIXER_SOURCES; i++)
+		hm_mixer_remove(mixer, i);
+}
 
-	if (channel->predelay > 0) {
-		channel->predelay--;
-		return;
+/*
+ * Moves a source's gain to gain over frame_count frames, then frees it if
+ * remove is set. A frame_count of 0 takes effect right away. -1 for a slot
+ * the mixer lacks.
+ */
+int
+hm_mixer_fade(struct hm_mixer *mixer, int slot, float gain,
+	uint32_t frame_count, int remove)
+{
+	struct hm_mixer_source *source;
+	if (slot < 0 || slot >= HM_MIXER_SOURCES)
+		return -1;
+	source = mixer->sources + slot;
+	source->fade_target = gain;
+	source->fade_frames = frame_count;
+	source->fade_step = frame_count
+		? (gain - source->gain) / (float) frame_count : 0.0f;
+	source->remove = remove;
+	if (!frame_count) {
+		source->gain = gain;
+		if (remove)
+			hm_mixer_remove(mixer, slot);
 	}
-	hm_update_ramps(ctx, channel);
-	hm_update_trills(ctx, channel);
-
-	dist = (sample->relative_note)
-		- (channel->base_note + channel->coarse_detune
-		+ (channel->trills[0].result * channel->trills[0].enabled));
-	if (dist < 0)
-		for (i = 0; i > dist; i--)
-			step_size *= 1 + FREQUENCY_MULTIPLIER;
-	else if (dist > 0)
-		for (i = 0; i < dist; i++)
-			step_size *= 1 - FREQUENCY_MULTIPLIER;
+	return 0;
+}
 
-	step_size *= 1 + ((channel->fine_detune
-		+ (channel->trills[1].result * channel->trills[1].enabled))
-		* (FREQUENCY_MULTIPLIER / 100.0f));
+/* Fades from out and removes it while to fades in from silence */
+int
+hm_mixer_crossfade(struct hm_mixer *mixer, int from, int to, float gain,
+	uint32_t frame_count)
+{
+	if (from < 0 || from >= HM_MIXER_SOURCES
+		|| to < 0 || to >= HM_MIXER_SOURCES)
+		return -1;
+	mixer->sources[to].gain = 0.0f;
+	hm_mixer_fade(mixer, to, gain, frame_count, 0);
+	hm_mixer_fade(mixer, from, 0.0f, frame_count, 1);
+	return 0;
+}
 
-	step_size *=  ((double) sample->sample_rate / (double) ctx->rate);
-	step_size += channel->pos_between_samples;
+/* Adds a source's block to the mix, following its fade */
+static int
+hm_mixer_accumulate(struct hm_mixer *mixer, int slot, uint32_t count)
+{
+	struct hm_mixer_source *source;
+	const float *frames;
+	float gain;
+	uint32_t i, fading;
 
-	channel->sample_frame += (uint32_t) step_size;
-	step_size -= (uint32_t) step_size;
-	channel->pos_between_samples = step_size;
+	if (slot < 0 || slot >= HM_MIXER_SOURCES || !mixer->sources[slot].ctx)
+		return -1;
+	source = mixer->sources + slot;
+	frames = source->ctx->scratch;
+	gain = source->gain;
+	fading = source->fade_frames < count ? source->fade_frames : count;
+	for (i = 0; i < fading; i++) {
+		gain = source->gain + source->fade_step * (float) (i + 1);
+		mixer->mix[i * 2] += frames[i * 2] * gain;
+		mixer->mix[i * 2 + 1] += frames[i * 2 + 1] * gain;
+	}
+	if (source->fade_frames) {
+		source->fade_frames -= fading;
+		source->gain = source->fade_frames ? gain : source->fade_target;
+		gain = source->gain;
+		if (!source->fade_frames && source->remove)
+			return hm_mixer_remove(mixer, slot);
+	}
+	for (; i < count; i++) {
+		mixer->mix[i * 2] += frames[i * 2] * gain;
+		mixer->mix[i * 2 + 1] += frames[i * 2 + 1] * gain;
+	}
+	return 0;
+}
 
-	if ((channel->sample_frame + 1) < sample->frame_count) {
-		hm_read_sample(sample, channel->sample_frame, &l1, &r1);
-		hm_read_sample(sample, channel->sample_frame + 1, &l2, &r2);
-	} else if (channel->sample_frame < sample->frame_count) {
-		if (sample->loop) {
-			hm_read_sample(sample, channel->sample_frame, &l1,
-				&r1);
-			hm_read_sample(sample, sample->loop_start, &l2, &r2);
-		} else {
-			hm_read_sample(sample, channel->sample_frame, &l1, &r1);
-			l2 = r2 = 0.0f;
-		}
-	} else {
-		if (sample->loop) {
-			channel->sample_frame = (channel->sample_frame
-				% sample->frame_count) + sample->loop_start;
-			hm_read_sample(sample, channel->sample_frame, &l1,
-				&r1);
-			hm_read_sample(sample, channel->sample_frame + 1, &l2,
-				&r2);
-		} else {
-			channel->sample_frame = -1;
-			return;
+/*
+ * Renders every source a block at a time into each one's scratch buffer,
+ * sums them with their gains and writes the clamped total to output.
+ */
+void
+hm_mixer_generate(struct hm_mixer *mixer, const struct hm_output *output,
+	uint64_t sample_count)
+{
+	uint64_t offset = 0;
+	uint32_t count;
+	int i;
+	while (sample_count) {
+		count = sample_count < HM_BLOCK_FRAMES
+			? sample_count : HM_BLOCK_FRAMES;
+		memset(mixer->mix, 0, count * 2 * sizeof(float));
+		for (i = 0; i < HM_MIXER_SOURCES; i++) {
+			if (!mixer->sources[i].ctx)
+				continue;
+			hm_generate_samples(mixer->sources[i].ctx,
+				mixer->sources[i].ctx->scratch, count);
+			hm_mixer_accumulate(mixer, i, count);
 		}
+		hm_write_output(mixer->mix, count, output, offset);
+		offset += count;
+		sample_count -= count;
 	}
+}
 
-	l1 += step_size * (l2 - l1);
-	r1 += step_size * (r2 - r1);
+static void
+hm_write_le(uint8_t *data, uint32_t num, int bytes)
+{
+	int i;
+	for (i = 0; i < bytes; i++)
+		data[i] = (num >> (i * 8)) & 255;
+}
 
-	hm_pan_frame(&l1, &r1, channel->pan);
+static int
+hm_write_wav_header(struct hm_file_sink *state, uint32_t data_length)
+{
+	uint8_t header[44];
+	const uint32_t sample_size = state->format == HM_FORMAT_S16 ? 2 : 4;
+	memcpy(header, "RIFF", 4);
+	hm_write_le(header + 4, data_length + 36, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	hm_write_le(header + 16, 16, 4);
+	hm_write_le(header + 20, state->format == HM_FORMAT_S16 ? 1 : 3, 2);
+	hm_write_le(header + 22, 2, 2);
+	hm_write_le(header + 24, state->rate, 4);
+	hm_write_le(header + 28, state->rate * 2 * sample_size, 4);
+	hm_write_le(header + 32, 2 * sample_size, 2);
+	hm_write_le(header + 34, sample_size * 8, 2);
+	memcpy(header + 36, "data", 4);
+	hm_write_le(header + 40, data_length, 4);
+	return fwrite(header, 1, 44, state->file) == 44 ? 0 : -1;
+}
 
-	l1 *= channel->vol;
-	r1 *= channel->vol;
+static int
+hm_file_sink_write(void *user, const float *frames, uint32_t frame_count)
+{
+	struct hm_file_sink *state = user;
+	uint32_t i, count;
+	float value;
 
-	if (channel->key_off) {
-		channel->fadeout_timer++;
-		if (channel->fadeout_timer > sample->fadeout) {
-			channel->sample_frame = -1;
-		} else {
-			l1 += ((float) channel->fadeout_timer
-				/ (float) sample->fadeout) * (0.0f - l1);
-			r1 += ((float) channel->fadeout_timer
-				/ (float) sample->fadeout) * (0.0f - r1);
+	state->frames_written += frame_count;
+	if (state->format == HM_FORMAT_F32)
+		return fwrite(frames, 2 * sizeof(float), frame_count,
+			state->file) == frame_count ? 0 : -1;
+
+	while (frame_count) {
+		count = frame_count < HM_BLOCK_FRAMES
+			? frame_count : HM_BLOCK_FRAMES;
+		for (i = 0; i < count * 2; i++) {
+			/* Out-of-range frames would overflow the cast */
+			value = hm_clamp(frames[i]) * 32767.0f;
+			value += value < 0.0f ? -0.5f : 0.5f;
+			state->convert[i] = (int16_t) value;
 		}
+		if (fwrite(state->convert, 2 * sizeof(int16_t), count,
+			state->file) != count)
+			return -1;
+		frames += count * 2;
+		frame_count -= count;
 	}
-
-	if (l1 > 1.0f)
-		l1 = 1.0f;
-	if (r1 > 1.0f)
-		r1 = 1.0f;
-	if (l1 < -1.0f)
-		l1 = -1.0f;
-	if (r1 < -1.0f)
-		r1 = -1.0f;
-
-	*left += l1;
-	*right += r1;
+	return 0;
 }
 
-void
-hm_mixdown(struct hm_context *ctx, float *left, float *right)
+static int
+hm_file_sink_close(void *user)
 {
-	int i;
-	if (ctx->samples_left_in_tick <= 0)
-		hm_load_new_tick(ctx);
-	ctx->samples_left_in_tick--;
-	*left = *right = 0.0f;
+	struct hm_file_sink *state = user;
+	const uint64_t data_length = state->frames_written * 2
+		* (state->format == HM_FORMAT_S16 ? 2 : 4);
+	if (!state->wav || data_length > UINT32_MAX - 36)
+		return fflush(state->file);
 
-	for (i = 0; i < ctx->num_channels; i++)
-		hm_channel_generate_sample(ctx, ctx->channels + i, left, right);
+	/* Streams that can't seek keep the open-ended sizes */
+	if (fseek(state->file, 0, SEEK_SET))
+		return fflush(state->file);
+	if (hm_write_wav_header(state, data_length))
+		return -1;
+	return fseek(state->file, 0, SEEK_END) || fflush(state->file);
+}
 
-	if (*left > 1.0f)
-		*left = 1.0f;
-	if (*right > 1.0f)
-		*right = 1.0f;
-	if (*left < -1.0f)
-		*left = -1.0f;
-	if (*right < -1.0f)
-		*right = -1.0f;
+/*
+ * Sets up a sink writing raw interleaved PCM, or a WAV file when wav is
+ * set, in HM_FORMAT_F32 or HM_FORMAT_S16. The WAV header is written now
+ * and its sizes are filled in when the export closes the sink.
+ */
+int
+hm_file_sink(struct hm_sink *sink, struct hm_file_sink *state, FILE *file,
+	uint32_t rate, int format, int wav)
+{
+	memset(state, 0, sizeof(struct hm_file_sink));
+	state->file = file;
+	state->rate = rate;
+	state->format = format;
+	state->wav = wav;
+	sink->write = hm_file_sink_write;
+	sink->close = hm_file_sink_close;
+	sink->user = state;
+	return wav ? hm_write_wav_header(state, UINT32_MAX - 36) : 0;
 }
 
-void
-hm_generate_samples(struct hm_context *ctx, float *buffer, uint64_t sample_count)
+#ifndef HM_NO_THREADS
+struct hm_export_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct hm_sink *sink;
+	float *chunks[HM_EXPORT_BUFFERS];
+	uint32_t lengths[HM_EXPORT_BUFFERS];
+	uint32_t head; // Next chunk to render
+	uint32_t tail; // Next chunk to hand to the sink
+	int done;
+	int error;
+};
+
+static void *
+hm_export_thread(void *data)
 {
-	uint64_t i;
-	for (i = 0; i < sample_count; i++)
-		hm_mixdown(ctx, &buffer[i * 2], &buffer[i * 2 + 1]);
+	struct hm_export_queue *queue = data;
+	uint32_t slot;
+	int error;
+	pthread_mutex_lock(&queue->lock);
+	while (1) {
+		while (queue->tail == queue->head && !queue->done)
+			pthread_cond_wait(&queue->changed, &queue->lock);
+		if (queue->tail == queue->head)
+			break;
+		slot = queue->tail % HM_EXPORT_BUFFERS;
+		pthread_mutex_unlock(&queue->lock);
+
+		error = queue->sink->write(queue->sink->user,
+			queue->chunks[slot], queue->lengths[slot]);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->tail++;
+		if (error) {
+			queue->error = error;
+			queue->done = 1;
+			queue->tail = queue->head;
+		}
+		pthread_cond_signal(&queue->changed);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
 }
+#endif
 
-void
-hm_free_context(struct hm_context *ctx)
+/*
+ * Renders frame_count frames in chunks of chunk_frames and streams them to
+ * sink. The sink runs on its own thread while the next chunks render, with
+ * at most HM_EXPORT_BUFFERS chunks allocated, so memory stays the same
+ * however long the song is. Returns nonzero if allocation or the sink
+ * failed, or if chunk_frames is 0.
+ */
+int
+hm_export(struct hm_context *ctx, struct hm_sink *sink, uint64_t frame_count,
+	uint32_t chunk_frames)
 {
-	int i;
-	if (!ctx)
-		return;
-	free(ctx->data);
-	for (i = 0; i < ctx->num_samples; i++)
-		if (ctx->samples[i].frames)
-			free(ctx->samples[i].frames);
-	free(ctx->samples);
-	free(ctx);
+#ifndef HM_NO_THREADS
+	struct hm_export_queue queue;
+	pthread_t thread;
+	uint32_t slot;
+	int i, error = 0;
+
+	if (!chunk_frames)
+		return -1;
+	memset(&queue, 0, sizeof(queue));
+	queue.sink = sink;
+	for (i = 0; i < HM_EXPORT_BUFFERS; i++) {
+		queue.chunks[i] = malloc(chunk_frames * 2 * sizeof(float));
+		if (!queue.chunks[i])
+			error = -1;
+	}
+	if (error || pthread_mutex_init(&queue.lock, NULL)) {
+		for (i = 0; i < HM_EXPORT_BUFFERS; i++)
+			free(queue.chunks[i]);
+		return -1;
+	}
+	pthread_cond_init(&queue.changed, NULL);
+	if (pthread_create(&thread, NULL, hm_export_thread, &queue)) {
+		error = -1;
+		frame_count = 0;
+	}
+
+	pthread_mutex_lock(&queue.lock);
+	while (frame_count && !queue.done) {
+		while (queue.head - queue.tail == HM_EXPORT_BUFFERS
+			&& !queue.done)
+			pthread_cond_wait(&queue.changed, &queue.lock);
+		if (queue.done)
+			break;
+		slot = queue.head % HM_EXPORT_BUFFERS;
+		pthread_mutex_unlock(&queue.lock);
+
+		queue.lengths[slot] = frame_count < chunk_frames
+			? frame_count : chunk_frames;
+		hm_generate_samples(ctx, queue.chunks[slot],
+			queue.lengths[slot]);
+		frame_count -= queue.lengths[slot];
+
+		pthread_mutex_lock(&queue.lock);
+		queue.head++;
+		pthread_cond_signal(&queue.changed);
+	}
+	queue.done = 1;
+	pthread_cond_signal(&queue.changed);
+	pthread_mutex_unlock(&queue.lock);
+
+	if (!error)
+		pthread_join(thread, NULL);
+	error = error ? error : queue.error;
+	pthread_cond_destroy(&queue.changed);
+	pthread_mutex_destroy(&queue.lock);
+	for (i = 0; i < HM_EXPORT_BUFFERS; i++)
+		free(queue.chunks[i]);
+#else
+	float *chunk = chunk_frames
+		? malloc(chunk_frames * 2 * sizeof(float)) : NULL;
+	uint32_t count;
+	int error = chunk ? 0 : -1;
+	while (frame_count && !error) {
+		count = frame_count < chunk_frames ? frame_count : chunk_frames;
+		hm_generate_samples(ctx, chunk, count);
+		error = sink->write(sink->user, chunk, count);
+		frame_count -= count;
+	}
+	free(chunk);
+#endif
+	if (sink->close && sink->close(sink->user) && !error)
+		error = -1;
+	return error;
 }
@@ -0,0 +1,237 @@
+/*
+ * Writes the modules render_check plays into a directory. They only use
+ * PCM samples, so no OGG encoder is needed to make them.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PI 3.14159265358979323846
+
+#define SAMPLE_U8 0
+#define SAMPLE_S16 1
+
+#define SCORE_COMMANDS 0 // Random notes and every command
+#define SCORE_PLAIN 1 // Random notes, no commands
+#define SCORE_WIDE 2 // Notes across the whole keyboard
+#define SCORE_ROOT 3 // Notes at the samples' own pitch only
+#define SCORE_LATE 4 // Random notes, the last two instruments from LATE_TICK
+
+struct buffer {
+	uint8_t *data;
+	uint32_t length;
+	uint32_t size;
+};
+
+struct sample_spec {
+	uint8_t instrument;
+	uint8_t format;
+	uint8_t channels;
+	uint32_t frame_count;
+	uint32_t sample_rate;
+	uint8_t loop;
+	uint32_t loop_start;
+	uint16_t pan;
+	uint16_t vol;
+	uint8_t relative_note;
+	uint8_t key_range_start;
+	uint8_t key_range_end;
+	uint8_t envelope;
+	uint16_t envelope_ms[6];
+	double frequency;
+};
+
+static const struct sample_spec samples[] = {
+	{ 1, SAMPLE_S16, 1, 3000, 22050, 1, 1000, 32767, 60000, 60, 0, 59,
+		1, { 5, 20, 30, 40, 30000, 50 }, 440.0 },
+	{ 1, SAMPLE_U8, 2, 2000, 11025, 0, 0, 20000, 65535, 60, 60, 127,
+		0, { 0, 0, 0, 0, 0, 80 }, 300.0 },
+	{ 2, SAMPLE_S16, 2, 4000, 44100, 1, 0, 50000, 50000, 48, 0, 127,
+		1, { 0, 10, 0, 100, 50000, 20 }, 220.0 },
+	{ 3, SAMPLE_S16, 2, 1500, 32000, 0, 0, 32767, 65535, 72, 0, 127,
+		0, { 0, 0, 0, 0, 0, 10 }, 880.0 },
+	{ 4, SAMPLE_U8, 1, 5000, 8000, 1, 2500, 32767, 40000, 60, 0, 127,
+		1, { 2, 3, 4, 5, 65535, 30 }, 100.0 }
+};
+
+#define NUM_SAMPLES (sizeof(samples) / sizeof(samples[0]))
+#define NUM_CHANNELS 6
+#define LENGTH 96
+#define LOOP_POSITION 16
+#define LATE_TICK 48 // Well after the ticks hm_open_context waits for
+
+static uint32_t seed;
+
+/* A fixed generator, so every libc writes the same modules */
+static uint32_t
+next_random(uint32_t range)
+{
+	seed = seed * 1103515245u + 12345u;
+	return (seed >> 16) % range;
+}
+
+static void
+write_8(struct buffer *buffer, uint8_t value)
+{
+	if (buffer->length == buffer->size) {
+		buffer->size = buffer->size ? buffer->size * 2 : 4096;
+		buffer->data = realloc(buffer->data, buffer->size);
+		if (!buffer->data) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	buffer->data[buffer->length++] = value;
+}
+
+static void
+write_16(struct buffer *buffer, uint16_t value)
+{
+	write_8(buffer, value >> 8);
+	write_8(buffer, value & 255);
+}
+
+static void
+write_32(struct buffer *buffer, uint32_t value)
+{
+	write_16(buffer, value >> 16);
+	write_16(buffer, value & 65535);
+}
+
+static void
+write_sample(struct buffer *buffer, const struct sample_spec *spec)
+{
+	const int bytes = spec->format == SAMPLE_S16 ? 2 : 1;
+	double value;
+	int16_t frame;
+	uint32_t i;
+	int c, j;
+
+	write_8(buffer, spec->instrument);
+	write_8(buffer, 0);
+	write_32(buffer, spec->frame_count * spec->channels * bytes);
+	write_32(buffer, spec->frame_count);
+	write_32(buffer, spec->sample_rate);
+	write_8(buffer, spec->format == SAMPLE_S16);
+	write_8(buffer, spec->channels);
+	write_8(buffer, spec->loop);
+	write_32(buffer, spec->loop_start);
+	write_16(buffer, spec->pan);
+	write_16(buffer, spec->vol);
+	write_8(buffer, spec->relative_note);
+	write_8(buffer, spec->key_range_start);
+	write_8(buffer, spec->key_range_end);
+	write_8(buffer, spec->envelope);
+	for (j = 0; j < 6; j++)
+		write_16(buffer, spec->envelope_ms[j]);
+
+	/* A sine per channel, fading out unless the sample loops */
+	for (i = 0; i < spec->frame_count; i++) {
+		for (c = 0; c < spec->channels; c++) {
+			value = 0.8 * sin(2.0 * PI * spec->frequency * (c + 1)
+				* i / spec->sample_rate);
+			if (!spec->loop)
+				value *= 1.0 - (double) i / spec->frame_count;
+			if (spec->format == SAMPLE_U8) {
+				write_8(buffer, (uint8_t) (value * 127.0
+					+ 128.0));
+			} else {
+				/* Little endian, as the editor saves them */
+				frame = (int16_t) (value * 32767.0);
+				write_8(buffer, (uint16_t) frame & 255);
+				write_8(buffer, (uint16_t) frame >> 8);
+			}
+		}
+	}
+}
+
+static void
+write_cell(struct buffer *buffer, int score, int tick)
+{
+	static const uint8_t roots[] = { 48, 72, 60 };
+	uint8_t note = 0, instrument = 0, command = 0, param = 0;
+	uint32_t roll = next_random(100);
+	int k;
+
+	if (roll < 25) {
+		note = 0x80 | (score == SCORE_WIDE ? 1 + next_random(127)
+			: 41 + next_random(40));
+		instrument = 1 + next_random(4);
+	} else if (roll < 30) {
+		note = 0x80;
+	}
+	if (score == SCORE_ROOT && note > 0x80) {
+		k = next_random(3);
+		instrument = 2 + k;
+		note = 0x80 | (roots[k] + 1);
+	}
+	if (score == SCORE_LATE && tick < LATE_TICK && instrument > 2)
+		instrument -= 2;
+	if (score == SCORE_COMMANDS && next_random(100) < 30) {
+		command = 1 + next_random(7);
+		if (command <= 4 && !next_random(3))
+			command |= next_random(4) << 4;
+		if (command == 6 || command == 7)
+			command |= 16 * next_random(2);
+		param = next_random(256);
+		if (command == 5)
+			param = next_random(40);
+	}
+	write_8(buffer, note);
+	write_8(buffer, instrument);
+	write_8(buffer, command);
+	write_8(buffer, param);
+}
+
+static int
+write_module(const char *directory, const char *name, int score)
+{
+	struct buffer buffer = { 0 };
+	char path[1024];
+	FILE *file;
+	uint32_t i;
+	int tick, c, error;
+
+	seed = 1234 + score;
+	for (i = 0; i < 14; i++)
+		write_8(&buffer, "Hacky Module: "[i]);
+	for (i = 0; i <= strlen(name); i++)
+		write_8(&buffer, name[i]);
+	write_8(&buffer, NUM_CHANNELS);
+	write_8(&buffer, NUM_SAMPLES);
+	write_8(&buffer, 150);
+	write_8(&buffer, 4);
+	write_16(&buffer, LENGTH);
+	write_16(&buffer, LOOP_POSITION);
+	for (i = 0; i < NUM_SAMPLES; i++)
+		write_sample(&buffer, samples + i);
+	for (tick = 0; tick < LENGTH; tick++)
+		for (c = 0; c < NUM_CHANNELS; c++)
+			write_cell(&buffer, score, tick);
+
+	snprintf(path, sizeof(path), "%s/%s.hm", directory, name);
+	file = fopen(path, "wb");
+	error = !file || fwrite(buffer.data, buffer.length, 1, file) != 1;
+	if (file && fclose(file))
+		error = 1;
+	if (error)
+		fprintf(stderr, "can't write %s\n", path);
+	free(buffer.data);
+	return error;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *directory = argc > 1 ? argv[1] : "modules";
+	int error = 0;
+
+	error |= write_module(directory, "commands", SCORE_COMMANDS);
+	error |= write_module(directory, "plain", SCORE_PLAIN);
+	error |= write_module(directory, "wide", SCORE_WIDE);
+	error |= write_module(directory, "root", SCORE_ROOT);
+	error |= write_module(directory, "late", SCORE_LATE);
+	return error;
+}
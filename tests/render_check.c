@@ -0,0 +1,550 @@
+/*
+ * Renders modules through each of the library's render paths and checks
+ * them against the scalar hm_mixdown path of a plainly loaded context.
+ *
+ *	render_check module...
+ *
+ * Prints one line per module and path and exits with 1 if any of them
+ * strayed past what that path is allowed.
+ */
+#include "hm_reader.h"
+#include <pthread.h>
+#include <time.h>
+
+#define RENDER_BLOCK 0 // hm_generate_samples
+#define RENDER_STEMS 1 // Master mix of hm_generate_stems
+#define RENDER_EXPORT 2 // Chunks handed to an hm_export sink
+#define RENDER_RESAMPLED 3 // Block path with HM_RESAMPLE_FIXED samples
+#define RENDER_PLANAR 4 // hm_generate_output into separate buffers
+#define RENDER_LOOP_CACHE 5 // Block path with HM_CACHE_LOOP
+#define RENDER_LOOP_CACHE_S16 6 // The same, recorded with HM_CACHE_LOOP_S16
+#define RENDER_HERMITE 7 // Block path, both sides HM_INTERPOLATE_HERMITE
+#define RENDER_SINC 8 // Block path, both sides HM_INTERPOLATE_SINC16
+/* Block path with every sample packed, decoded at its notes or prefetched */
+#define RENDER_PACKED 9
+/* Block path with samples taken from another context's HM_SHARE_SAMPLES */
+#define RENDER_SHARED 10
+#define RENDER_BAKED 11 // Block path loaded from an hm_bake file
+/*
+ * Block path opened with hm_open_context. The first half plays while the
+ * samples past the opening ones are held back, against a reference with
+ * those muted.
+ */
+#define RENDER_PROGRESSIVE 12
+#define RENDER_MIX_RATE 13 // Block path mixed at half the rate
+/* Block path with HM_MIPMAP against hm_mixdown with HM_INTERPOLATE_SINC16 */
+#define RENDER_MIPMAP 14
+#define RENDER_MODES 15
+
+#define RATE 48000
+#define SECONDS 20 // Long enough for the loop cache to play a pass
+#define CHUNK_FRAMES 1000
+#define CHECK_FRAMES 1024
+#define REFERENCE_TAPS 32 // Each side of the sinc upsampling RENDER_MIX_RATE's
+
+struct render_mode {
+	const char *name;
+	double max_error; // Largest difference from hm_mixdown allowed
+	double rms_error;
+};
+
+static const struct render_mode modes[RENDER_MODES] = {
+	{ "block", 1e-5, 1e-5 },
+	{ "stems", 1e-5, 1e-5 },
+	{ "export", 1e-5, 1e-5 },
+	/*
+	 * Resampling at load filters differently from interpolating at the
+	 * voice, so single frames can be far apart. On the whole the
+	 * difference has to stay 40 dB under the modules, 0.3 RMS or more.
+	 */
+	{ "resampled", 1e-1, 3e-3 },
+	{ "planar", 1e-5, 1e-5 },
+	{ "loop_cache", 1e-5, 1e-5 },
+	/* Recorded passes are rounded to 16 bits, up to half a step off */
+	{ "loop_cache_s16", 1e-5 + 0.5 / 32767.0, 1e-5 + 0.5 / 32767.0 },
+	{ "hermite", 1e-5, 1e-5 },
+	{ "sinc", 1e-5, 1e-5 },
+	{ "packed", 1e-5, 1e-5 },
+	{ "shared", 1e-5, 1e-5 },
+	{ "baked", 1e-5, 1e-5 },
+	{ "progressive", 1e-5, 1e-5 },
+	/*
+	 * Against the mix at half the rate, upsampled by a sinc four times
+	 * longer than the bus's. They part on sharp edges and just below the
+	 * half rate's Nyquist frequency. Half a mixed frame of drift would
+	 * put the RMS difference over 3e-2.
+	 */
+	{ "mix_rate", 3e-1, 1.5e-2 },
+	/*
+	 * Sinc interpolation still folds back what a note transposed up
+	 * carries over Nyquist, and the mipmaps filter it out, so single
+	 * frames can be far apart on high notes. Notes at a sample's own
+	 * pitch stay within 2e-3 RMS, and a mip level read a frame off
+	 * puts the whole over 1.5e-1.
+	 */
+	{ "mipmap", 1.0, 2e-2 }
+};
+
+struct render_report {
+	uint64_t frames;
+	double max_error;
+	double rms_error;
+	int64_t first_divergence; // First frame off by more than max_error
+};
+
+struct render_check {
+	struct hm_context *reference;
+	struct render_report *report;
+	double tolerance;
+	float *expected;
+	double square_sum;
+	float *mixed; // Reference at the mixing rate, for RENDER_MIX_RATE
+	uint64_t mixed_frames;
+	uint32_t step; // Output frames per mixed frame
+};
+
+/* sinc(x) under a Blackman window that closes at x = +-half */
+static double
+blackman_sinc(double x, double half)
+{
+	const double pi = 3.14159265358979323846;
+	const double sinc = x == 0.0 ? 1.0 : sin(pi * x) / (pi * x);
+	if (x <= -half || x >= half)
+		return 0.0;
+	return sinc * (0.42 + 0.5 * cos(pi * x / half)
+		+ 0.08 * cos(2.0 * pi * x / half));
+}
+
+/* The mixed reference at output frame, band limited to 0.9 of its Nyquist */
+static void
+upsample_frame(const struct render_check *check, uint64_t frame,
+	float *out)
+{
+	const double t = (double) frame / check->step;
+	const int64_t first = (int64_t) t - REFERENCE_TAPS + 1;
+	double weight, sum = 0.0, left = 0.0, right = 0.0;
+	int64_t n;
+
+	for (n = first; n < first + REFERENCE_TAPS * 2; n++) {
+		weight = blackman_sinc((t - n) * 0.9, REFERENCE_TAPS * 0.9);
+		sum += weight;
+		if (n < 0 || n >= (int64_t) check->mixed_frames)
+			continue;
+		left += check->mixed[n * 2] * weight;
+		right += check->mixed[n * 2 + 1] * weight;
+	}
+	/* The bus clamps what it resamples, as hm_mixdown does */
+	out[0] = hm_clamp(left / sum);
+	out[1] = hm_clamp(right / sum);
+}
+
+/*
+ * Reader over the module in memory, for RENDER_PROGRESSIVE. While held,
+ * reads wait unless they come from the thread that opened the module.
+ */
+struct memory_reader {
+	const uint8_t *data;
+	pthread_t opener;
+	pthread_mutex_t lock;
+	pthread_cond_t released;
+	int held;
+	float *muted[256]; // Frames the reference can't play until released
+};
+
+static int
+read_memory(void *user, uint64_t offset, void *buffer, uint32_t length)
+{
+	struct memory_reader *reader = user;
+	pthread_mutex_lock(&reader->lock);
+	while (reader->held && !pthread_equal(pthread_self(), reader->opener))
+		pthread_cond_wait(&reader->released, &reader->lock);
+	pthread_mutex_unlock(&reader->lock);
+	memcpy(buffer, reader->data + offset, length);
+	return 0;
+}
+
+static void
+release_reader(struct memory_reader *reader)
+{
+	pthread_mutex_lock(&reader->lock);
+	reader->held = 0;
+	pthread_cond_broadcast(&reader->released);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+/*
+ * Mutes the samples ctx hasn't read in the reference, which has them all
+ * decoded, by taking their frames as hm_open_context leaves them.
+ */
+static void
+mute_samples(const struct hm_context *ctx, struct hm_context *reference,
+	struct memory_reader *reader)
+{
+	struct hm_sample *sample;
+	int i;
+	for (i = 0; i < reference->num_samples; i++) {
+		sample = reference->samples + i;
+		if (atomic_load(&ctx->samples[i].loaded))
+			continue;
+		reader->muted[i] = sample->frames;
+		sample->frames = NULL;
+		atomic_store(&sample->loaded, 0);
+	}
+}
+
+/*
+ * Lets the held samples in and waits for them, then gives the reference
+ * its frames back. Returns -1 if one couldn't be read.
+ */
+static int
+finish_loading(struct hm_context *ctx, struct hm_context *reference,
+	struct memory_reader *reader)
+{
+	const struct timespec pause = { 0, 1000000 };
+	struct hm_sample *sample;
+	int i, loading;
+
+	release_reader(reader);
+	while ((loading = hm_loading(ctx)) > 0)
+		nanosleep(&pause, NULL);
+	for (i = 0; i < reference->num_samples; i++) {
+		sample = reference->samples + i;
+		if (reader->muted[i]) {
+			sample->frames = reader->muted[i];
+			reader->muted[i] = NULL;
+			atomic_store(&sample->loaded, 1);
+		}
+	}
+	return loading;
+}
+
+static int
+check_frames(void *user, const float *frames, uint32_t frame_count)
+{
+	struct render_check *check = user;
+	struct render_report *report = check->report;
+	uint32_t i, count;
+	double error;
+	while (frame_count) {
+		count = frame_count < CHECK_FRAMES ? frame_count : CHECK_FRAMES;
+		for (i = 0; i < count; i++) {
+			if (check->mixed)
+				upsample_frame(check, report->frames + i,
+					check->expected + i * 2);
+			else
+				hm_mixdown(check->reference,
+					check->expected + i * 2,
+					check->expected + i * 2 + 1);
+		}
+		for (i = 0; i < count * 2; i++) {
+			error = frames[i] - check->expected[i];
+			if (error < 0.0)
+				error = -error;
+			check->square_sum += error * error;
+			if (error > report->max_error)
+				report->max_error = error;
+			if (error > check->tolerance
+				&& report->first_divergence < 0)
+				report->first_divergence = report->frames
+					+ i / 2;
+		}
+		report->frames += count;
+		frames += count * 2;
+		frame_count -= count;
+	}
+	return 0;
+}
+
+/*
+ * Renders a module through the scalar hm_mixdown path and through one of
+ * the RENDER_ paths, in pieces of chunk_frames, and reports how far apart
+ * they are. Returns 1 if the output diverged past what that path allows,
+ * -1 if something couldn't be set up.
+ */
+static int
+compare_render(const void *data, uint32_t data_length, uint32_t rate,
+	int mode, uint64_t frame_count, uint32_t chunk_frames,
+	struct render_report *report)
+{
+	struct hm_context *ctx = NULL, *owner = NULL;
+	struct render_check check;
+	struct hm_load_options options = { 0 };
+	struct hm_sink sink;
+	struct hm_reader reader;
+	struct memory_reader memory = { 0 };
+	FILE *file = NULL;
+	void *baked = NULL;
+	long baked_length;
+	struct hm_output output;
+	float *buffer = NULL, **stems = NULL;
+	uint64_t held_frames = 0;
+	uint32_t i, count;
+	int error = 0, interpolation;
+
+	memset(report, 0, sizeof(struct render_report));
+	report->first_divergence = -1;
+	memset(&check, 0, sizeof(check));
+	check.report = report;
+	check.tolerance = modes[mode].max_error;
+	if (mode == RENDER_RESAMPLED)
+		options.flags |= HM_RESAMPLE_FIXED;
+	if (mode == RENDER_LOOP_CACHE)
+		options.flags |= HM_CACHE_LOOP;
+	if (mode == RENDER_LOOP_CACHE_S16)
+		options.flags |= HM_CACHE_LOOP | HM_CACHE_LOOP_S16;
+	if (mode == RENDER_MIX_RATE)
+		options.mix_rate = rate / 2;
+	if (mode == RENDER_MIPMAP)
+		options.flags |= HM_MIPMAP;
+	if (mode == RENDER_PROGRESSIVE) {
+		memory.data = data;
+		memory.opener = pthread_self();
+		memory.held = 1;
+		pthread_mutex_init(&memory.lock, NULL);
+		pthread_cond_init(&memory.released, NULL);
+	}
+	/* A budget no sample fits keeps evicting and decoding them again */
+	if (mode == RENDER_PACKED) {
+		options.flags |= HM_PACK_PCM;
+		options.sample_budget = 1;
+	}
+	if (mode == RENDER_SHARED) {
+		options.flags |= HM_SHARE_SAMPLES;
+		/* Decodes everything first, so ctx only finds them cached */
+		if (hm_create_context_ex(&owner, data, data_length, rate,
+			&options))
+			return -1;
+	}
+	if (mode == RENDER_BAKED) {
+		file = tmpfile();
+		if (!file || hm_bake(file, data, data_length, rate, &options)
+			|| (baked_length = ftell(file)) <= 0
+			|| !(baked = malloc(baked_length))
+			|| fseek(file, 0, SEEK_SET)
+			|| fread(baked, baked_length, 1, file) != 1) {
+			error = -1;
+			goto done;
+		}
+		options.baked = baked;
+		options.baked_length = baked_length;
+	}
+	check.expected = malloc(CHECK_FRAMES * 2 * sizeof(float));
+	check.step = mode == RENDER_MIX_RATE ? 2 : 1;
+	if (!check.expected || hm_create_context(&check.reference, data,
+		data_length, rate / check.step)) {
+		error = -1;
+		goto done;
+	}
+	/* Mixed whole up front, as each output frame reads taps ahead */
+	if (mode == RENDER_MIX_RATE) {
+		check.mixed_frames = frame_count / check.step + REFERENCE_TAPS;
+		check.mixed = malloc(check.mixed_frames * 2 * sizeof(float));
+		if (!check.mixed) {
+			error = -1;
+			goto done;
+		}
+		for (i = 0; i < check.mixed_frames; i++)
+			hm_mixdown(check.reference, check.mixed + i * 2,
+				check.mixed + i * 2 + 1);
+	}
+	if (mode == RENDER_PROGRESSIVE) {
+		reader.read = read_memory;
+		reader.user = &memory;
+		error = hm_open_context(&ctx, &reader, data_length, rate,
+			&options);
+		/* Notes of samples not in yet play nothing on both sides */
+		if (!error) {
+			mute_samples(ctx, check.reference, &memory);
+			held_frames = frame_count / 2;
+		}
+	} else {
+		error = hm_create_context_ex(&ctx, data, data_length, rate,
+			&options);
+	}
+	if (error) {
+		error = -1;
+		goto done;
+	}
+	if (mode == RENDER_HERMITE || mode == RENDER_SINC) {
+		interpolation = mode == RENDER_HERMITE
+			? HM_INTERPOLATE_HERMITE : HM_INTERPOLATE_SINC16;
+		if (hm_set_interpolation(check.reference, interpolation)
+			|| hm_set_interpolation(ctx, interpolation)) {
+			error = -1;
+			goto done;
+		}
+	}
+	if (mode == RENDER_MIPMAP && hm_set_interpolation(check.reference,
+		HM_INTERPOLATE_SINC16)) {
+		error = -1;
+		goto done;
+	}
+	if (mode == RENDER_PACKED && hm_set_prefetch(ctx, 4)) {
+		error = -1;
+		goto done;
+	}
+	/* A file that was not taken would only check the decoded path */
+	if (mode == RENDER_BAKED)
+		for (i = 0; i < ctx->num_samples; i++)
+			if (!ctx->samples[i].baked) {
+				error = -1;
+				goto done;
+			}
+
+	if (mode == RENDER_EXPORT) {
+		sink.write = check_frames;
+		sink.close = NULL;
+		sink.user = &check;
+		error = hm_export(ctx, &sink, frame_count, chunk_frames);
+		goto done;
+	}
+
+	buffer = malloc(chunk_frames * 2 * sizeof(float));
+	stems = calloc(HM_MAX_CHANNELS, sizeof(float *));
+	if (!buffer || !stems) {
+		error = -1;
+		goto done;
+	}
+	if (mode == RENDER_STEMS) {
+		for (i = 0; i < ctx->num_channels; i++) {
+			stems[i] = malloc(chunk_frames * 2 * sizeof(float));
+			if (!stems[i])
+				error = -1;
+		}
+	}
+	if (mode == RENDER_PLANAR) {
+		stems[0] = malloc(chunk_frames * 2 * sizeof(float));
+		if (!stems[0])
+			error = -1;
+		output.left = stems[0];
+		output.right = stems[0] + chunk_frames;
+		output.stride = 1;
+		output.gain = 1.0f;
+		output.flags = 0;
+	}
+	while (frame_count && !error) {
+		count = frame_count < chunk_frames ? frame_count : chunk_frames;
+		if (held_frames && count > held_frames)
+			count = held_frames;
+		if (mode == RENDER_PROGRESSIVE && !held_frames
+			&& memory.held && finish_loading(ctx, check.reference,
+			&memory)) {
+			error = -1;
+			break;
+		}
+		if (mode == RENDER_STEMS) {
+			hm_generate_stems(ctx, stems, NULL, ctx->num_channels,
+				buffer, count);
+		} else if (mode == RENDER_PLANAR) {
+			hm_generate_output(ctx, &output, count);
+			for (i = 0; i < count; i++) {
+				buffer[i * 2] = output.left[i];
+				buffer[i * 2 + 1] = output.right[i];
+			}
+		} else {
+			hm_generate_samples(ctx, buffer, count);
+		}
+		check_frames(&check, buffer, count);
+		frame_count -= count;
+		if (held_frames)
+			held_frames -= count;
+	}
+
+done:
+	if (report->frames)
+		report->rms_error = sqrt(check.square_sum
+			/ (report->frames * 2));
+	if (stems)
+		for (i = 0; i < HM_MAX_CHANNELS; i++)
+			free(stems[i]);
+	free(stems);
+	free(buffer);
+	free(check.expected);
+	free(check.mixed);
+	/* The load thread can't finish while reads are held */
+	if (memory.held)
+		release_reader(&memory);
+	if (check.reference)
+		for (i = 0; i < check.reference->num_samples; i++)
+			if (memory.muted[i])
+				check.reference->samples[i].frames =
+					memory.muted[i];
+	hm_free_context(ctx);
+	hm_free_context(owner);
+	hm_free_context(check.reference);
+	free(baked);
+	if (file)
+		fclose(file);
+	if (mode == RENDER_PROGRESSIVE) {
+		pthread_cond_destroy(&memory.released);
+		pthread_mutex_destroy(&memory.lock);
+	}
+	if (error)
+		return -1;
+	return report->first_divergence >= 0
+		|| report->rms_error > modes[mode].rms_error;
+}
+
+static uint8_t *
+read_file(const char *path, uint32_t *length)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *data = NULL;
+	long size;
+
+	if (!file)
+		return NULL;
+	if (!fseek(file, 0, SEEK_END) && (size = ftell(file)) > 0
+		&& !fseek(file, 0, SEEK_SET) && (data = malloc(size))
+		&& fread(data, size, 1, file) == 1) {
+		*length = size;
+	} else {
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	return data;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct render_report report;
+	uint32_t length;
+	uint8_t *data;
+	int i, mode, result, failed = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s module...\n", argv[0]);
+		return 2;
+	}
+	for (i = 1; i < argc; i++) {
+		data = read_file(argv[i], &length);
+		if (!data) {
+			printf("%s: can't read\n", argv[i]);
+			failed = 1;
+			continue;
+		}
+		for (mode = 0; mode < RENDER_MODES; mode++) {
+			result = compare_render(data, length, RATE, mode,
+				(uint64_t) RATE * SECONDS, CHUNK_FRAMES,
+				&report);
+			printf("%s %-15s max %.3g rms %.3g", argv[i],
+				modes[mode].name, report.max_error,
+				report.rms_error);
+			if (result < 0)
+				printf(" FAILED to set up\n");
+			else if (report.first_divergence >= 0)
+				printf(" FAILED from frame %lld\n",
+					(long long) report.first_divergence);
+			else if (result)
+				printf(" FAILED on rms\n");
+			else
+				printf(" ok\n");
+			if (result)
+				failed = 1;
+		}
+		free(data);
+	}
+	return failed;
+}